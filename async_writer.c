@@ -0,0 +1,215 @@
+#include "async_writer.h"
+#include <libavutil/avutil.h>
+#include <SDL.h>
+#include <SDL_thread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int write_all (int fd, const uint8_t *data, int size)
+{
+    ssize_t n;
+
+    while (size > 0)
+    {
+        n = write (fd, data, size);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return AVERROR (errno);
+        }
+
+        data += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+static int writer_thread (void *arg)
+{
+    AsyncWriter *w = arg;
+    AsyncBuffer *buf;
+    int size, ret;
+
+    for (;;)
+    {
+        SDL_LockMutex (w->mutex);
+
+        while (!w->nb_filled && !w->eof)
+            SDL_CondWait (w->cond, w->mutex);
+
+        if (!w->nb_filled)
+        {
+            SDL_UnlockMutex (w->mutex);
+            break;
+        }
+
+        buf = &w->buffers[w->write_index];
+
+        SDL_UnlockMutex (w->mutex);
+
+        // O_DIRECT wants whole blocks, the tail is cut off again on close
+        size = buf->size;
+        if (w->direct)
+            size = FFALIGN (size, ASYNC_WRITER_ALIGN);
+
+        ret = write_all (w->fd, buf->data, size);
+
+        SDL_LockMutex (w->mutex);
+
+        if (ret < 0 && !w->error)
+            w->error = ret;
+        w->written += buf->size;
+        buf->size = 0;
+        w->write_index = (w->write_index + 1) % w->nb_buffers;
+        w->nb_filled--;
+
+        SDL_CondSignal (w->cond);
+        SDL_UnlockMutex (w->mutex);
+    }
+
+    return 0;
+}
+
+static void free_buffers (AsyncWriter *w)
+{
+    int i;
+
+    for (i = 0; i < w->nb_buffers; i++)
+        free (w->buffers[i].data);
+
+    av_freep (&w->buffers);
+}
+
+int async_writer_open (AsyncWriter *w, const char *filename, int depth,
+                       int buffer_size, bool direct)
+{
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    int i;
+
+    memset (w, 0, sizeof *w);
+
+    w->fd = -1;
+    w->nb_buffers = FFMAX (depth, 2);
+    w->buffer_size = FFALIGN (buffer_size, ASYNC_WRITER_ALIGN);
+
+#ifdef O_DIRECT
+    if (direct)
+    {
+        w->fd = open (filename, flags | O_DIRECT, 0644);
+        w->direct = w->fd >= 0;
+        if (!w->direct)
+            av_log (NULL, AV_LOG_WARNING,
+                    "O_DIRECT not supported for %s, using buffered I/O\n",
+                    filename);
+    }
+#endif
+
+    if (w->fd < 0)
+        w->fd = open (filename, flags, 0644);
+    if (w->fd < 0)
+        return AVERROR (errno);
+
+    w->buffers = av_mallocz (w->nb_buffers * sizeof *w->buffers);
+    if (!w->buffers)
+        goto fail;
+
+    for (i = 0; i < w->nb_buffers; i++)
+    {
+        if (posix_memalign ((void **)&w->buffers[i].data, ASYNC_WRITER_ALIGN,
+                            w->buffer_size))
+            goto fail;
+    }
+
+    w->mutex = SDL_CreateMutex ();
+    w->cond = SDL_CreateCond ();
+    w->thread = SDL_CreateThread (writer_thread, w);
+    if (!w->thread)
+        goto fail;
+
+    return 0;
+
+fail:
+    if (w->buffers)
+        free_buffers (w);
+    SDL_DestroyCond (w->cond);
+    SDL_DestroyMutex (w->mutex);
+    close (w->fd);
+
+    return AVERROR (ENOMEM);
+}
+
+// Hands the current buffer to the thread and waits until the next one is free.
+static int submit (AsyncWriter *w)
+{
+    int ret;
+
+    SDL_LockMutex (w->mutex);
+
+    w->nb_filled++;
+    w->fill_index = (w->fill_index + 1) % w->nb_buffers;
+    SDL_CondSignal (w->cond);
+
+    while (w->nb_filled == w->nb_buffers)
+        SDL_CondWait (w->cond, w->mutex);
+
+    ret = w->error;
+
+    SDL_UnlockMutex (w->mutex);
+
+    return ret;
+}
+
+int async_writer_write (AsyncWriter *w, const uint8_t *data, int size)
+{
+    AsyncBuffer *buf;
+    int n, ret;
+
+    while (size > 0)
+    {
+        buf = &w->buffers[w->fill_index];
+
+        n = FFMIN (size, w->buffer_size - buf->size);
+        memcpy (buf->data + buf->size, data, n);
+        buf->size += n;
+        data += n;
+        size -= n;
+
+        if (buf->size == w->buffer_size && (ret = submit (w)) < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+int async_writer_close (AsyncWriter *w)
+{
+    int ret;
+
+    if (w->buffers[w->fill_index].size > 0)
+        submit (w);
+
+    SDL_LockMutex (w->mutex);
+    w->eof = true;
+    SDL_CondSignal (w->cond);
+    SDL_UnlockMutex (w->mutex);
+
+    SDL_WaitThread (w->thread, NULL);
+
+    ret = w->error;
+
+    if (w->direct && ftruncate (w->fd, w->written) < 0 && !ret)
+        ret = AVERROR (errno);
+    if (close (w->fd) < 0 && !ret)
+        ret = AVERROR (errno);
+
+    free_buffers (w);
+    SDL_DestroyCond (w->cond);
+    SDL_DestroyMutex (w->mutex);
+
+    return ret;
+}
@@ -0,0 +1,55 @@
+#ifndef ASYNC_WRITER_H
+#define ASYNC_WRITER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ASYNC_WRITER_ALIGN 4096
+
+typedef struct SDL_mutex SDL_mutex;
+typedef struct SDL_cond SDL_cond;
+typedef struct SDL_Thread SDL_Thread;
+
+typedef struct AsyncBuffer
+{
+    uint8_t *data;
+    int size;
+} AsyncBuffer;
+
+// Sequential file writer that fills one buffer while a thread of its own
+// writes the others out, so the producer only waits when all of them are in
+// flight.
+typedef struct AsyncWriter
+{
+    int fd;
+    bool direct;
+    int64_t written;
+
+    AsyncBuffer *buffers;
+    int nb_buffers;
+    int buffer_size;
+
+    // the producer fills buffers[fill_index], the thread writes
+    // buffers[write_index], nb_filled are queued in between
+    int fill_index;
+    int write_index;
+    int nb_filled;
+    bool eof;
+    int error;
+
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+    SDL_Thread *thread;
+} AsyncWriter;
+
+// depth is the number of buffers (at least 2); direct asks for O_DIRECT and
+// falls back to buffered I/O where the file system refuses it
+int async_writer_open (AsyncWriter *w, const char *filename, int depth,
+                       int buffer_size, bool direct);
+
+int async_writer_write (AsyncWriter *w, const uint8_t *data, int size);
+
+// flushes the pending data, returns the first write error if any
+int async_writer_close (AsyncWriter *w);
+
+#endif // ASYNC_WRITER_H
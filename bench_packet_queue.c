@@ -0,0 +1,260 @@
+#include "packet_queue.h"
+#include <libavcodec/avcodec.h>
+#include <libavutil/time.h>
+#include <SDL.h>
+#include <SDL_thread.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_THREADS 16
+#define MAX_PACKETS 200000
+#define MAX_BYTES (256 * 1024 * 1024)
+#define QUEUE_CAPACITY 1024
+
+typedef struct BenchContext
+{
+    PacketQueue queue;
+    AVBufferRef *payload;
+    int packet_size;
+    int packets_per_producer;
+    int nb_produced;
+    int nb_consumed;
+    // av_buffer_ref calls, the only per-packet allocation outside the queue
+    int nb_refs;
+} BenchContext;
+
+typedef struct Worker
+{
+    BenchContext *bench;
+    SDL_Thread *thread;
+    int64_t *latencies;
+    int nb_latencies;
+} Worker;
+
+static int producer (void *arg)
+{
+    Worker *worker = arg;
+    BenchContext *bench = worker->bench;
+    AVPacket pkt;
+    int i;
+
+    for (i = 0; i < bench->packets_per_producer; i++)
+    {
+        // share one payload so that only the queue itself is measured
+        av_init_packet (&pkt);
+        pkt.buf = av_buffer_ref (bench->payload);
+        if (!pkt.buf)
+            return -1;
+        __atomic_add_fetch (&bench->nb_refs, 1, __ATOMIC_RELAXED);
+        pkt.data = pkt.buf->data;
+        pkt.size = bench->packet_size;
+        pkt.pts = av_gettime ();
+
+        if (packet_queue_put (&bench->queue, &pkt) < 0)
+        {
+            av_free_packet (&pkt);
+            return -1;
+        }
+
+        __atomic_add_fetch (&bench->nb_produced, 1, __ATOMIC_RELAXED);
+    }
+
+    return 0;
+}
+
+static int consumer (void *arg)
+{
+    Worker *worker = arg;
+    BenchContext *bench = worker->bench;
+    AVPacket pkt;
+
+    while (packet_queue_get (&bench->queue, &pkt, true) > 0)
+    {
+        worker->latencies[worker->nb_latencies++] = av_gettime () - pkt.pts;
+        av_free_packet (&pkt);
+
+        __atomic_add_fetch (&bench->nb_consumed, 1, __ATOMIC_RELAXED);
+    }
+
+    return 0;
+}
+
+static int compare_int64 (const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static int run (bool ring, int nb_producers, int nb_consumers, int packet_size)
+{
+    BenchContext bench = {0};
+    Worker producers[MAX_THREADS] = {{0}}, consumers[MAX_THREADS] = {{0}};
+    PacketQueueStats stats;
+    int64_t *latencies = NULL;
+    int64_t start, elapsed;
+    int total, nb_latencies;
+    int i, status, ret = -1;
+    bool failed = false;
+
+    bench.packet_size = packet_size;
+    bench.packets_per_producer = FFMIN (MAX_PACKETS, MAX_BYTES / packet_size)
+                                 / nb_producers;
+    total = bench.packets_per_producer * nb_producers;
+
+    if (ring)
+    {
+        if (packet_queue_init_ring (&bench.queue, QUEUE_CAPACITY) < 0)
+            goto end;
+    }
+    else
+    {
+        packet_queue_init (&bench.queue);
+        packet_queue_set_capacity (&bench.queue, QUEUE_CAPACITY, 0, 0);
+    }
+
+    bench.payload = av_buffer_alloc (packet_size);
+    latencies = av_malloc (total * sizeof *latencies);
+    if (!bench.payload || !latencies)
+        goto end;
+
+    // any consumer may end up taking every packet
+    consumers[0].latencies = latencies;
+    for (i = 1; i < nb_consumers; i++)
+    {
+        consumers[i].latencies = av_malloc (total * sizeof *latencies);
+        if (!consumers[i].latencies)
+            goto end;
+    }
+
+    for (i = 0; i < nb_consumers; i++)
+        consumers[i].bench = &bench;
+
+    start = av_gettime ();
+
+    for (i = 0; i < nb_consumers; i++)
+    {
+        consumers[i].thread = SDL_CreateThread (consumer, &consumers[i]);
+        if (!consumers[i].thread)
+            failed = true;
+    }
+
+    // without every consumer the queue might never drain
+    for (i = 0; i < nb_producers && !failed; i++)
+    {
+        producers[i].bench = &bench;
+        producers[i].thread = SDL_CreateThread (producer, &producers[i]);
+        if (!producers[i].thread)
+            failed = true;
+    }
+
+    for (i = 0; i < nb_producers; i++)
+    {
+        if (!producers[i].thread)
+            continue;
+
+        SDL_WaitThread (producers[i].thread, &status);
+        if (status < 0)
+            failed = true;
+    }
+
+    // only packets that were actually queued are counted as produced
+    while (!failed && __atomic_load_n (&bench.nb_consumed, __ATOMIC_RELAXED)
+           < __atomic_load_n (&bench.nb_produced, __ATOMIC_RELAXED))
+        SDL_Delay (1);
+
+    elapsed = av_gettime () - start;
+
+    packet_queue_stop (&bench.queue);
+
+    for (i = 0; i < nb_consumers; i++)
+        SDL_WaitThread (consumers[i].thread, NULL);
+
+    if (failed)
+    {
+        av_log (NULL, AV_LOG_ERROR,
+                "%s run with %d producers failed to queue every packet\n",
+                ring ? "ring" : "list", nb_producers);
+        goto end;
+    }
+
+    nb_latencies = consumers[0].nb_latencies;
+    for (i = 1; i < nb_consumers; i++)
+    {
+        memcpy (latencies + nb_latencies, consumers[i].latencies,
+                consumers[i].nb_latencies * sizeof *latencies);
+        nb_latencies += consumers[i].nb_latencies;
+    }
+
+    qsort (latencies, nb_latencies, sizeof *latencies, compare_int64);
+
+    packet_queue_get_stats (&bench.queue, &stats);
+
+    if (nb_latencies > 0)
+    {
+        printf ("%-4s %2dP %2dC %7d B %10.0f ops/s  latency us p50 %5"PRId64
+                " p90 %5"PRId64" p99 %6"PRId64" max %7"PRId64
+                "  allocs/op %.5f (queue %.5f)\n",
+                ring ? "ring" : "list", nb_producers, nb_consumers,
+                packet_size, nb_latencies / (elapsed / 1000000.0),
+                latencies[nb_latencies / 2],
+                latencies[(int64_t)nb_latencies * 90 / 100],
+                latencies[(int64_t)nb_latencies * 99 / 100],
+                latencies[nb_latencies - 1],
+                (double)(bench.nb_refs + stats.pool_misses) / nb_latencies,
+                (double)stats.pool_misses / nb_latencies);
+    }
+
+    ret = 0;
+
+end:
+    for (i = 1; i < nb_consumers; i++)
+        av_free (consumers[i].latencies);
+    av_free (latencies);
+    av_buffer_unref (&bench.payload);
+    packet_queue_destroy (&bench.queue);
+
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    static const int packet_sizes[] = { 64, 1024, 16384, 262144 };
+    int max_threads = 4;
+    int threads, i;
+
+    if (argc > 1)
+        max_threads = FFMAX (1, FFMIN (atoi (argv[1]), MAX_THREADS));
+
+    // threads and mutexes only, no video or audio
+    if (SDL_Init (0))
+    {
+        av_log (NULL, AV_LOG_ERROR, "Could not initialize SDL: %s\n",
+                SDL_GetError ());
+        return -1;
+    }
+
+    for (i = 0; i < FF_ARRAY_ELEMS (packet_sizes); i++)
+    {
+        if (run (true, 1, 1, packet_sizes[i]) < 0)
+            goto fail;
+
+        for (threads = 1; threads <= max_threads; threads++)
+        {
+            if (run (false, threads, threads, packet_sizes[i]) < 0)
+                goto fail;
+        }
+    }
+
+    SDL_Quit ();
+
+    return 0;
+
+fail:
+    av_log (NULL, AV_LOG_ERROR, "Benchmark run failed\n");
+    SDL_Quit ();
+
+    return -1;
+}
@@ -0,0 +1,44 @@
+#include "seek_index.h"
+#include <libavformat/avformat.h>
+#include <stdio.h>
+
+int main(int argc, char *argv[])
+{
+    char index_filename[1024];
+    SeekIndex index;
+    int ret;
+
+    if (argc < 2)
+    {
+        printf ("Usage: %s <filename> [<index_filename>]\n"
+                "  writes <filename>.idx unless index_filename is given\n",
+                argv[0]);
+        return -1;
+    }
+
+    if (argc > 2)
+        snprintf (index_filename, sizeof index_filename, "%s", argv[2]);
+    else
+        seek_index_filename (index_filename, sizeof index_filename, argv[1]);
+
+    av_register_all();
+
+    if ((ret = seek_index_build (argv[1], index_filename)) < 0)
+    {
+        av_log (NULL, AV_LOG_ERROR, "Could not build index of %s\n", argv[1]);
+        return -1;
+    }
+
+    if (seek_index_open (&index, index_filename, argv[1]) < 0)
+    {
+        av_log (NULL, AV_LOG_ERROR, "Could not read back %s\n", index_filename);
+        return -1;
+    }
+
+    av_log (NULL, AV_LOG_INFO, "%s: %d keyframes of stream %d\n",
+            index_filename, index.nb_entries, index.header->stream_index);
+
+    seek_index_close (&index);
+
+    return 0;
+}
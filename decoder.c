@@ -0,0 +1,26 @@
+#include "decoder.h"
+#include <libavcodec/avcodec.h>
+#include <libavutil/cpu.h>
+#include <string.h>
+
+int decoder_open (AVCodecContext *codec, AVCodec *decoder, int thread_count,
+                  int thread_type)
+{
+    codec->thread_count = thread_count > 0 ? thread_count : av_cpu_count ();
+    codec->thread_type = thread_type ? thread_type
+                                     : FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+    return avcodec_open2 (codec, decoder, NULL);
+}
+
+int decoder_parse_thread_type (const char *name)
+{
+    if (!strcmp (name, "frame"))
+        return FF_THREAD_FRAME;
+    if (!strcmp (name, "slice"))
+        return FF_THREAD_SLICE;
+    if (!strcmp (name, "auto"))
+        return 0;
+
+    return -1;
+}
@@ -0,0 +1,16 @@
+#ifndef DECODER_H
+#define DECODER_H
+
+typedef struct AVCodec AVCodec;
+typedef struct AVCodecContext AVCodecContext;
+
+// Opens codec with threaded decoding. thread_count 0 uses every available
+// core; thread_type is FF_THREAD_FRAME, FF_THREAD_SLICE or both (0), in which
+// case the decoder picks frame threading where it supports it.
+int decoder_open (AVCodecContext *codec, AVCodec *decoder, int thread_count,
+                  int thread_type);
+
+// "frame", "slice" or "auto", returns -1 for anything else
+int decoder_parse_thread_type (const char *name);
+
+#endif // DECODER_H
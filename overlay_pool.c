@@ -0,0 +1,267 @@
+#include "overlay_pool.h"
+#include <libavcodec/avcodec.h>
+#include <SDL.h>
+#include <SDL_thread.h>
+#include <stdint.h>
+#include <string.h>
+
+// references kept by decoders that do not report codec->refs
+#define OVERLAY_POOL_MIN_REFS 2
+// the frame just returned and the one on screen
+#define OVERLAY_POOL_DISPLAY_FRAMES 2
+
+int overlay_pool_init (OverlayPool *pool)
+{
+    memset (pool, 0, sizeof *pool);
+
+    pool->mutex = SDL_CreateMutex ();
+    if (!pool->mutex)
+        return -1;
+
+    return 0;
+}
+
+static void unlock_overlay (OverlayBuffer *buf)
+{
+    if (buf->locked)
+    {
+        SDL_UnlockYUVOverlay (buf->overlay);
+        buf->locked = false;
+    }
+}
+
+static void free_overlay (OverlayBuffer *buf)
+{
+    unlock_overlay (buf);
+    SDL_FreeYUVOverlay (buf->overlay);
+    buf->overlay = NULL;
+}
+
+void overlay_pool_destroy (OverlayPool *pool)
+{
+    int i;
+
+    for (i = 0; i < pool->nb_buffers; i++)
+    {
+        if (pool->buffers[i]->overlay)
+            free_overlay (pool->buffers[i]);
+        av_free (pool->buffers[i]);
+    }
+    av_freep (&pool->buffers);
+
+    SDL_DestroyMutex (pool->mutex);
+    pool->mutex = NULL;
+    pool->nb_buffers = 0;
+}
+
+// every frame the decoder may hold at once, so it never runs out of overlays
+static int pool_size (const AVCodecContext *codec)
+{
+    return FFMAX (codec->thread_count, 1)
+           + FFMAX (codec->refs, OVERLAY_POOL_MIN_REFS) + codec->has_b_frames
+           + OVERLAY_POOL_DISPLAY_FRAMES;
+}
+
+// appends a new empty buffer, called locked
+static OverlayBuffer *add_buffer (OverlayPool *pool)
+{
+    OverlayBuffer **buffers, *buf;
+
+    buf = av_mallocz (sizeof *buf);
+    if (!buf)
+        return NULL;
+
+    buffers = av_realloc (pool->buffers,
+                          (pool->nb_buffers + 1) * sizeof *buffers);
+    if (!buffers)
+    {
+        av_free (buf);
+        return NULL;
+    }
+
+    pool->buffers = buffers;
+    pool->buffers[pool->nb_buffers++] = buf;
+
+    return buf;
+}
+
+// Reuses an idle overlay of the right size or creates one while the pool holds
+// fewer than max_buffers, idle overlays of another size are dropped on the
+// way. The overlay comes back locked, so its pixels can be written.
+static OverlayBuffer *take_buffer (OverlayPool *pool, int width, int height,
+                                   int max_buffers)
+{
+    OverlayBuffer *buf, *found = NULL, *empty = NULL;
+    int i;
+
+    SDL_LockMutex (pool->mutex);
+
+    for (i = 0; i < pool->nb_buffers && !found; i++)
+    {
+        buf = pool->buffers[i];
+        if (buf->in_use)
+            continue;
+
+        if (buf->overlay && (buf->width != width || buf->height != height))
+            free_overlay (buf);
+
+        if (buf->overlay)
+            found = buf;
+        else if (!empty)
+            empty = buf;
+    }
+
+    if (!found && !empty && pool->nb_buffers < max_buffers)
+        empty = add_buffer (pool);
+
+    if (!found && empty)
+    {
+        empty->pool = pool;
+        empty->overlay = SDL_CreateYUVOverlay (width, height, SDL_YV12_OVERLAY,
+                                               pool->screen);
+        if (empty->overlay)
+        {
+            empty->width = width;
+            empty->height = height;
+            found = empty;
+        }
+    }
+
+    if (found && SDL_LockYUVOverlay (found->overlay) < 0)
+    {
+        free_overlay (found);
+        found = NULL;
+    }
+
+    if (found)
+    {
+        found->locked = true;
+        found->in_use = true;
+    }
+
+    SDL_UnlockMutex (pool->mutex);
+
+    return found;
+}
+
+static void release_buffer (void *opaque, uint8_t *data)
+{
+    OverlayBuffer *buf = opaque;
+
+    SDL_LockMutex (buf->pool->mutex);
+    unlock_overlay (buf);
+    buf->in_use = false;
+    SDL_UnlockMutex (buf->pool->mutex);
+}
+
+static int get_buffer (AVCodecContext *codec, AVFrame *frame, int flags)
+{
+    OverlayPool *pool = codec->opaque;
+    OverlayBuffer *buf;
+    SDL_Overlay *overlay;
+    int width = frame->width, height = frame->height;
+    int align[AV_NUM_DATA_POINTERS];
+    int i;
+
+    if (pool->disabled || !pool->screen
+        || frame->format != AV_PIX_FMT_YUV420P
+        || !(codec->codec->capabilities & CODEC_CAP_DR1))
+        return avcodec_default_get_buffer2 (codec, frame, flags);
+
+    // room for the decoder to write past the visible picture
+    avcodec_align_dimensions2 (codec, &width, &height, align);
+
+    buf = take_buffer (pool, width, height, pool_size (codec));
+    if (!buf)
+        return avcodec_default_get_buffer2 (codec, frame, flags);
+
+    // YV12 keeps V before U
+    overlay = buf->overlay;
+    frame->data[0] = overlay->pixels[0];
+    frame->data[1] = overlay->pixels[2];
+    frame->data[2] = overlay->pixels[1];
+    frame->linesize[0] = overlay->pitches[0];
+    frame->linesize[1] = overlay->pitches[2];
+    frame->linesize[2] = overlay->pitches[1];
+
+    for (i = 0; i < 3; i++)
+    {
+        if (frame->linesize[i] % align[i]
+            || (uintptr_t)frame->data[i] % align[i])
+        {
+            av_log (codec, AV_LOG_WARNING, "Overlay layout does not suit the "
+                    "decoder, falling back to copying\n");
+            pool->disabled = true;
+            release_buffer (buf, NULL);
+            memset (frame->data, 0, sizeof frame->data);
+            memset (frame->linesize, 0, sizeof frame->linesize);
+            return avcodec_default_get_buffer2 (codec, frame, flags);
+        }
+    }
+
+    frame->buf[0] = av_buffer_create (overlay->pixels[0],
+                                      overlay->pitches[0] * height,
+                                      release_buffer, buf, 0);
+    if (!frame->buf[0])
+    {
+        release_buffer (buf, NULL);
+        return AVERROR (ENOMEM);
+    }
+
+    frame->extended_data = frame->data;
+
+    return 0;
+}
+
+void overlay_pool_attach (OverlayPool *pool, AVCodecContext *codec)
+{
+    codec->opaque = pool;
+    codec->get_buffer2 = get_buffer;
+    // the overlays have no room for edges around the picture
+    codec->flags |= CODEC_FLAG_EMU_EDGE;
+}
+
+bool overlay_pool_display (OverlayPool *pool, const AVFrame *frame, int x,
+                           int y)
+{
+    OverlayBuffer *buf = NULL;
+    bool shown = false;
+    void *opaque;
+    int i;
+
+    // get_buffer made the overlay buffer the opaque of frame->buf[0], the
+    // decoder's own buffers never carry one of ours
+    if (!frame->buf[0])
+        return false;
+
+    opaque = av_buffer_get_opaque (frame->buf[0]);
+
+    SDL_LockMutex (pool->mutex);
+
+    for (i = 0; i < pool->nb_buffers && !buf; i++)
+    {
+        if (opaque == pool->buffers[i])
+            buf = pool->buffers[i];
+    }
+
+    // a cropped picture no longer starts at the overlay's origin and has to
+    // be copied
+    if (buf && buf->overlay && frame->data[0] == buf->overlay->pixels[0])
+    {
+        // the overlay is padded to the decoder's alignment, SDL clips the
+        // padding at the screen edge
+        SDL_Rect rect = { x, y, buf->overlay->w, buf->overlay->h };
+
+        // SDL only displays unlocked overlays, the decoder may go on reading
+        // this one as a reference once it is locked again
+        unlock_overlay (buf);
+        SDL_DisplayYUVOverlay (buf->overlay, &rect);
+        if (SDL_LockYUVOverlay (buf->overlay) == 0)
+            buf->locked = true;
+        shown = true;
+    }
+
+    SDL_UnlockMutex (pool->mutex);
+
+    return shown;
+}
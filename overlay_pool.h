@@ -0,0 +1,56 @@
+#ifndef OVERLAY_POOL_H
+#define OVERLAY_POOL_H
+
+#include <stdbool.h>
+
+typedef struct AVCodecContext AVCodecContext;
+typedef struct AVFrame AVFrame;
+typedef struct SDL_mutex SDL_mutex;
+typedef struct SDL_Overlay SDL_Overlay;
+typedef struct SDL_Surface SDL_Surface;
+
+struct OverlayPool;
+
+typedef struct OverlayBuffer
+{
+    struct OverlayPool *pool;
+    SDL_Overlay *overlay;
+    int width, height;
+    bool in_use;
+    bool locked;
+} OverlayBuffer;
+
+// Hands the decoder YV12 overlays to decode into, so YUV420P pictures are
+// displayed without a copy. An overlay stays locked from get_buffer2 until the
+// decoder releases its buffer, also while it serves as a reference, and is
+// only unlocked for the moment it is displayed. The pool holds as many
+// overlays as the decoder's threads, references and the displayed frames
+// need.
+typedef struct OverlayPool
+{
+    SDL_Surface *screen;
+    SDL_mutex *mutex;
+    // allocated one by one, the decoder's buffers point at them
+    OverlayBuffer **buffers;
+    int nb_buffers;
+
+    // set once the overlay layout did not suit the decoder
+    bool disabled;
+} OverlayPool;
+
+int overlay_pool_init (OverlayPool *pool);
+
+// all frames of the codec must have been released
+void overlay_pool_destroy (OverlayPool *pool);
+
+// installs the pool as get_buffer2 of codec, before it is opened; overlays
+// are only created once screen is set
+void overlay_pool_attach (OverlayPool *pool, AVCodecContext *codec);
+
+// Displays the overlay frame was decoded into with its top left corner at x,
+// y. Returns false if the frame came from somewhere else or is cropped, then
+// its data is still valid for copying.
+bool overlay_pool_display (OverlayPool *pool, const AVFrame *frame, int x,
+                           int y);
+
+#endif // OVERLAY_POOL_H
@@ -0,0 +1,396 @@
+#include "overlay_upload.h"
+#include <libavcodec/avcodec.h>
+#include <libavutil/cpu.h>
+#include <SDL.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#else
+#define HAVE_X86 0
+#endif
+
+typedef struct UploadKernels
+{
+    // n bytes
+    void (*copy) (uint8_t *dst, const uint8_t *src, int n);
+    // n pairs of interleaved bytes
+    void (*split) (uint8_t *u, uint8_t *v, const uint8_t *src, int n);
+    // n little-endian 16-bit samples, keeping their high byte
+    void (*narrow) (uint8_t *dst, const uint16_t *src, int n);
+    // n pairs of interleaved 16-bit samples
+    void (*narrow_split) (uint8_t *u, uint8_t *v, const uint16_t *src, int n);
+    void (*fence) (void);
+} UploadKernels;
+
+static void copy_c (uint8_t *dst, const uint8_t *src, int n)
+{
+    memcpy (dst, src, n);
+}
+
+static void split_c (uint8_t *u, uint8_t *v, const uint8_t *src, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        u[i] = src[2 * i];
+        v[i] = src[2 * i + 1];
+    }
+}
+
+static void narrow_c (uint8_t *dst, const uint16_t *src, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        dst[i] = src[i] >> 8;
+}
+
+static void narrow_split_c (uint8_t *u, uint8_t *v, const uint16_t *src, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        u[i] = src[2 * i] >> 8;
+        v[i] = src[2 * i + 1] >> 8;
+    }
+}
+
+static void fence_c (void)
+{
+}
+
+#if HAVE_X86
+
+// Each SIMD kernel does the scalar version on the head until dst is aligned
+// for streaming stores, and on whatever tail is left. For the split kernels
+// the v plane is streamed only if it happens to share u's alignment.
+
+#define ALIGN_HEAD(p, align, n) \
+    FFMIN ((int)((-(uintptr_t)(p)) & ((align) - 1)), (n))
+
+__attribute__((target("sse2")))
+static void copy_sse2 (uint8_t *dst, const uint8_t *src, int n)
+{
+    int i = ALIGN_HEAD (dst, 16, n);
+
+    memcpy (dst, src, i);
+
+    for (; i + 64 <= n; i += 64)
+    {
+        __m128i a = _mm_loadu_si128 ((const __m128i *)(src + i));
+        __m128i b = _mm_loadu_si128 ((const __m128i *)(src + i + 16));
+        __m128i c = _mm_loadu_si128 ((const __m128i *)(src + i + 32));
+        __m128i d = _mm_loadu_si128 ((const __m128i *)(src + i + 48));
+
+        _mm_stream_si128 ((__m128i *)(dst + i), a);
+        _mm_stream_si128 ((__m128i *)(dst + i + 16), b);
+        _mm_stream_si128 ((__m128i *)(dst + i + 32), c);
+        _mm_stream_si128 ((__m128i *)(dst + i + 48), d);
+    }
+
+    for (; i + 16 <= n; i += 16)
+        _mm_stream_si128 ((__m128i *)(dst + i),
+                          _mm_loadu_si128 ((const __m128i *)(src + i)));
+
+    memcpy (dst + i, src + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void split_sse2 (uint8_t *u, uint8_t *v, const uint8_t *src, int n)
+{
+    const __m128i mask = _mm_set1_epi16 (0x00ff);
+    int i = ALIGN_HEAD (u, 16, n);
+    int stream_v = !(((uintptr_t)v + i) & 15);
+
+    split_c (u, v, src, i);
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_loadu_si128 ((const __m128i *)(src + 2 * i));
+        __m128i b = _mm_loadu_si128 ((const __m128i *)(src + 2 * i + 16));
+        __m128i lo = _mm_packus_epi16 (_mm_and_si128 (a, mask),
+                                       _mm_and_si128 (b, mask));
+        __m128i hi = _mm_packus_epi16 (_mm_srli_epi16 (a, 8),
+                                       _mm_srli_epi16 (b, 8));
+
+        _mm_stream_si128 ((__m128i *)(u + i), lo);
+        if (stream_v)
+            _mm_stream_si128 ((__m128i *)(v + i), hi);
+        else
+            _mm_storeu_si128 ((__m128i *)(v + i), hi);
+    }
+
+    split_c (u + i, v + i, src + 2 * i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void narrow_sse2 (uint8_t *dst, const uint16_t *src, int n)
+{
+    int i = ALIGN_HEAD (dst, 16, n);
+
+    narrow_c (dst, src, i);
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_loadu_si128 ((const __m128i *)(src + i));
+        __m128i b = _mm_loadu_si128 ((const __m128i *)(src + i + 8));
+
+        _mm_stream_si128 ((__m128i *)(dst + i),
+                          _mm_packus_epi16 (_mm_srli_epi16 (a, 8),
+                                            _mm_srli_epi16 (b, 8)));
+    }
+
+    narrow_c (dst + i, src + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void narrow_split_sse2 (uint8_t *u, uint8_t *v, const uint16_t *src,
+                               int n)
+{
+    const __m128i mask = _mm_set1_epi16 (0x00ff);
+    int i = ALIGN_HEAD (u, 16, n);
+    int stream_v = !(((uintptr_t)v + i) & 15);
+
+    narrow_split_c (u, v, src, i);
+
+    for (; i + 16 <= n; i += 16)
+    {
+        const __m128i *p = (const __m128i *)(src + 2 * i);
+        // high bytes of 16 interleaved pairs, still interleaved
+        __m128i a = _mm_packus_epi16 (_mm_srli_epi16 (_mm_loadu_si128 (p), 8),
+                                      _mm_srli_epi16 (_mm_loadu_si128 (p + 1), 8));
+        __m128i b = _mm_packus_epi16 (_mm_srli_epi16 (_mm_loadu_si128 (p + 2), 8),
+                                      _mm_srli_epi16 (_mm_loadu_si128 (p + 3), 8));
+        __m128i lo = _mm_packus_epi16 (_mm_and_si128 (a, mask),
+                                       _mm_and_si128 (b, mask));
+        __m128i hi = _mm_packus_epi16 (_mm_srli_epi16 (a, 8),
+                                       _mm_srli_epi16 (b, 8));
+
+        _mm_stream_si128 ((__m128i *)(u + i), lo);
+        if (stream_v)
+            _mm_stream_si128 ((__m128i *)(v + i), hi);
+        else
+            _mm_storeu_si128 ((__m128i *)(v + i), hi);
+    }
+
+    narrow_split_c (u + i, v + i, src + 2 * i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void fence_sse2 (void)
+{
+    // streaming stores are weakly ordered, publish them before display
+    _mm_sfence ();
+}
+
+#ifdef AV_CPU_FLAG_AVX2
+
+// packus works within 128-bit lanes, this puts the quadwords back in order
+#define FIX_LANES(x) _mm256_permute4x64_epi64 ((x), _MM_SHUFFLE (3, 1, 2, 0))
+
+__attribute__((target("avx2")))
+static void copy_avx2 (uint8_t *dst, const uint8_t *src, int n)
+{
+    int i = ALIGN_HEAD (dst, 32, n);
+
+    memcpy (dst, src, i);
+
+    for (; i + 128 <= n; i += 128)
+    {
+        __m256i a = _mm256_loadu_si256 ((const __m256i *)(src + i));
+        __m256i b = _mm256_loadu_si256 ((const __m256i *)(src + i + 32));
+        __m256i c = _mm256_loadu_si256 ((const __m256i *)(src + i + 64));
+        __m256i d = _mm256_loadu_si256 ((const __m256i *)(src + i + 96));
+
+        _mm256_stream_si256 ((__m256i *)(dst + i), a);
+        _mm256_stream_si256 ((__m256i *)(dst + i + 32), b);
+        _mm256_stream_si256 ((__m256i *)(dst + i + 64), c);
+        _mm256_stream_si256 ((__m256i *)(dst + i + 96), d);
+    }
+
+    for (; i + 32 <= n; i += 32)
+        _mm256_stream_si256 ((__m256i *)(dst + i),
+                             _mm256_loadu_si256 ((const __m256i *)(src + i)));
+
+    memcpy (dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void split_avx2 (uint8_t *u, uint8_t *v, const uint8_t *src, int n)
+{
+    const __m256i mask = _mm256_set1_epi16 (0x00ff);
+    int i = ALIGN_HEAD (u, 32, n);
+    int stream_v = !(((uintptr_t)v + i) & 31);
+
+    split_c (u, v, src, i);
+
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256 ((const __m256i *)(src + 2 * i));
+        __m256i b = _mm256_loadu_si256 ((const __m256i *)(src + 2 * i + 32));
+        __m256i lo = FIX_LANES (_mm256_packus_epi16 (_mm256_and_si256 (a, mask),
+                                                     _mm256_and_si256 (b, mask)));
+        __m256i hi = FIX_LANES (_mm256_packus_epi16 (_mm256_srli_epi16 (a, 8),
+                                                     _mm256_srli_epi16 (b, 8)));
+
+        _mm256_stream_si256 ((__m256i *)(u + i), lo);
+        if (stream_v)
+            _mm256_stream_si256 ((__m256i *)(v + i), hi);
+        else
+            _mm256_storeu_si256 ((__m256i *)(v + i), hi);
+    }
+
+    split_c (u + i, v + i, src + 2 * i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void narrow_avx2 (uint8_t *dst, const uint16_t *src, int n)
+{
+    int i = ALIGN_HEAD (dst, 32, n);
+
+    narrow_c (dst, src, i);
+
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256 ((const __m256i *)(src + i));
+        __m256i b = _mm256_loadu_si256 ((const __m256i *)(src + i + 16));
+
+        _mm256_stream_si256 ((__m256i *)(dst + i),
+                             FIX_LANES (_mm256_packus_epi16 (
+                                            _mm256_srli_epi16 (a, 8),
+                                            _mm256_srli_epi16 (b, 8))));
+    }
+
+    narrow_c (dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void narrow_split_avx2 (uint8_t *u, uint8_t *v, const uint16_t *src,
+                               int n)
+{
+    const __m256i mask = _mm256_set1_epi16 (0x00ff);
+    int i = ALIGN_HEAD (u, 32, n);
+    int stream_v = !(((uintptr_t)v + i) & 31);
+
+    narrow_split_c (u, v, src, i);
+
+    for (; i + 32 <= n; i += 32)
+    {
+        const __m256i *p = (const __m256i *)(src + 2 * i);
+        __m256i a = FIX_LANES (_mm256_packus_epi16 (
+                                   _mm256_srli_epi16 (_mm256_loadu_si256 (p), 8),
+                                   _mm256_srli_epi16 (_mm256_loadu_si256 (p + 1), 8)));
+        __m256i b = FIX_LANES (_mm256_packus_epi16 (
+                                   _mm256_srli_epi16 (_mm256_loadu_si256 (p + 2), 8),
+                                   _mm256_srli_epi16 (_mm256_loadu_si256 (p + 3), 8)));
+        __m256i lo = FIX_LANES (_mm256_packus_epi16 (_mm256_and_si256 (a, mask),
+                                                     _mm256_and_si256 (b, mask)));
+        __m256i hi = FIX_LANES (_mm256_packus_epi16 (_mm256_srli_epi16 (a, 8),
+                                                     _mm256_srli_epi16 (b, 8)));
+
+        _mm256_stream_si256 ((__m256i *)(u + i), lo);
+        if (stream_v)
+            _mm256_stream_si256 ((__m256i *)(v + i), hi);
+        else
+            _mm256_storeu_si256 ((__m256i *)(v + i), hi);
+    }
+
+    narrow_split_c (u + i, v + i, src + 2 * i, n - i);
+}
+
+#endif // AV_CPU_FLAG_AVX2
+#endif // HAVE_X86
+
+static const UploadKernels *get_kernels (void)
+{
+    static const UploadKernels kernels_c =
+    {
+        copy_c, split_c, narrow_c, narrow_split_c, fence_c
+    };
+#if HAVE_X86
+    static const UploadKernels kernels_sse2 =
+    {
+        copy_sse2, split_sse2, narrow_sse2, narrow_split_sse2, fence_sse2
+    };
+#ifdef AV_CPU_FLAG_AVX2
+    static const UploadKernels kernels_avx2 =
+    {
+        copy_avx2, split_avx2, narrow_avx2, narrow_split_avx2, fence_sse2
+    };
+#endif
+    int flags = av_get_cpu_flags ();
+
+#ifdef AV_CPU_FLAG_AVX2
+    if (flags & AV_CPU_FLAG_AVX2)
+        return &kernels_avx2;
+#endif
+    if (flags & AV_CPU_FLAG_SSE2)
+        return &kernels_sse2;
+#endif
+
+    return &kernels_c;
+}
+
+int overlay_upload (SDL_Overlay *overlay, const AVFrame *frame, int pix_fmt,
+                    int width, int height)
+{
+    static const UploadKernels *k;
+    // YV12 keeps V before U
+    uint8_t *y = overlay->pixels[0];
+    uint8_t *v = overlay->pixels[1];
+    uint8_t *u = overlay->pixels[2];
+    int cw = (width + 1) >> 1, ch = (height + 1) >> 1;
+    int row;
+
+    if (!k)
+        k = get_kernels ();
+
+    switch (pix_fmt)
+    {
+    case AV_PIX_FMT_YUV420P:
+        for (row = 0; row < height; row++)
+            k->copy (y + row * overlay->pitches[0],
+                     frame->data[0] + row * frame->linesize[0], width);
+        for (row = 0; row < ch; row++)
+        {
+            k->copy (u + row * overlay->pitches[2],
+                     frame->data[1] + row * frame->linesize[1], cw);
+            k->copy (v + row * overlay->pitches[1],
+                     frame->data[2] + row * frame->linesize[2], cw);
+        }
+        break;
+
+    case AV_PIX_FMT_NV12:
+        for (row = 0; row < height; row++)
+            k->copy (y + row * overlay->pitches[0],
+                     frame->data[0] + row * frame->linesize[0], width);
+        for (row = 0; row < ch; row++)
+            k->split (u + row * overlay->pitches[2], v + row * overlay->pitches[1],
+                      frame->data[1] + row * frame->linesize[1], cw);
+        break;
+
+    case AV_PIX_FMT_P010LE:
+        for (row = 0; row < height; row++)
+            k->narrow (y + row * overlay->pitches[0],
+                       (const uint16_t *)(frame->data[0]
+                                          + row * frame->linesize[0]), width);
+        for (row = 0; row < ch; row++)
+            k->narrow_split (u + row * overlay->pitches[2],
+                             v + row * overlay->pitches[1],
+                             (const uint16_t *)(frame->data[1]
+                                                + row * frame->linesize[1]), cw);
+        break;
+
+    default:
+        return -1;
+    }
+
+    k->fence ();
+
+    return 0;
+}
@@ -0,0 +1,14 @@
+#ifndef OVERLAY_UPLOAD_H
+#define OVERLAY_UPLOAD_H
+
+typedef struct AVFrame AVFrame;
+typedef struct SDL_Overlay SDL_Overlay;
+
+// Copies a YUV420P, NV12 or P010 picture into a locked YV12 overlay with
+// streaming stores where the CPU has them, since overlay memory is often
+// write-combined and never read back. Returns a negative value for any
+// other format.
+int overlay_upload (SDL_Overlay *overlay, const AVFrame *frame, int pix_fmt,
+                    int width, int height);
+
+#endif // OVERLAY_UPLOAD_H
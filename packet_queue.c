@@ -1,33 +1,360 @@
 #include "packet_queue.h"
 #include <libavformat/avformat.h>
+#include <libavutil/time.h>
 #include <SDL.h>
 #include <SDL_thread.h>
 
+#define PACKET_QUEUE_SLAB_SIZE 64
+
+// The first node of every slab only links the slabs together, the rest go
+// to the free list.
+static int pool_grow (PacketQueue *q)
+{
+    AVPacketList *slab;
+    int i;
+
+    slab = av_malloc (PACKET_QUEUE_SLAB_SIZE * sizeof *slab);
+    if (!slab)
+        return -1;
+
+    slab[0].next = q->slabs;
+    q->slabs = slab;
+
+    for (i = 1; i < PACKET_QUEUE_SLAB_SIZE; i++)
+    {
+        slab[i].next = q->free_nodes;
+        q->free_nodes = &slab[i];
+    }
+
+    return 0;
+}
+
+static AVPacketList *node_alloc (PacketQueue *q)
+{
+    AVPacketList *node;
+
+    if (q->free_nodes)
+    {
+        q->stats.pool_hits++;
+    }
+    else
+    {
+        q->stats.pool_misses++;
+        if (pool_grow (q) < 0)
+            return NULL;
+    }
+
+    node = q->free_nodes;
+    q->free_nodes = node->next;
+
+    return node;
+}
+
+static void node_free (PacketQueue *q, AVPacketList *node)
+{
+    node->next = q->free_nodes;
+    q->free_nodes = node;
+}
+
 void packet_queue_init (PacketQueue *q)
 {
     memset (q, 0, sizeof *q);
     q->stop_request = false;
     q->mutex = SDL_CreateMutex ();
     q->cond = SDL_CreateCond ();
+    q->not_full = SDL_CreateCond ();
+    q->start_time = av_gettime ();
+
+    // not fatal, put will retry
+    pool_grow (q);
 }
 
-int packet_queue_put (PacketQueue *q, AVPacket *pkt)
+int packet_queue_init_ring (PacketQueue *q, unsigned capacity)
 {
-    AVPacketList *node;
+    unsigned n = 1;
 
-    if (q->stop_request)
-        return -1;
+    packet_queue_init (q);
+
+    while (n < capacity)
+        n <<= 1;
 
-    if (av_dup_packet (pkt) < 0)
+    q->ring = av_mallocz (n * sizeof *q->ring);
+    if (!q->ring)
         return -1;
 
-    SDL_LockMutex(q->mutex);
+    q->ring_capacity = n;
+
+    return 0;
+}
+
+void packet_queue_destroy (PacketQueue *q)
+{
+    AVPacketList *slab, *next_slab;
+
+    packet_queue_flush (q);
+
+    for (slab = q->slabs; slab != NULL; slab = next_slab)
+    {
+        next_slab = slab->next;
+        av_free (slab);
+    }
+
+    q->slabs = NULL;
+    q->free_nodes = NULL;
+
+    av_freep (&q->ring);
+    SDL_DestroyCond (q->not_full);
+    SDL_DestroyCond (q->cond);
+    SDL_DestroyMutex (q->mutex);
+}
+
+void packet_queue_set_capacity (PacketQueue *q, int max_packets, int max_size,
+                                int64_t max_duration)
+{
+    SDL_LockMutex (q->mutex);
 
-    node = av_malloc (sizeof *node);
-    if (!node)
+    q->max_packets = max_packets;
+    q->max_size = max_size;
+    q->max_duration = max_duration;
+
+    SDL_CondBroadcast (q->not_full);
+    SDL_CondBroadcast (q->cond);
+    SDL_UnlockMutex (q->mutex);
+}
+
+// An empty queue always accepts a packet, so a single packet larger than the
+// limits cannot stall the producer forever.
+static bool queue_full (PacketQueue *q)
+{
+    int nb_packets = __atomic_load_n (&q->nb_packets, __ATOMIC_RELAXED);
+
+    if (nb_packets == 0)
+        return false;
+
+    return (q->max_packets && nb_packets >= q->max_packets)
+        || (q->max_size && __atomic_load_n (&q->size, __ATOMIC_RELAXED)
+                               >= q->max_size)
+        || (q->max_duration && __atomic_load_n (&q->duration, __ATOMIC_RELAXED)
+                                   >= q->max_duration);
+}
+
+static void stats_put (PacketQueue *q, AVPacket *pkt)
+{
+    PacketQueueStats *stats = &q->stats;
+    int bucket = pkt->size > 0 ? av_log2 (pkt->size) : 0;
+
+    stats->nb_puts++;
+    stats->put_bytes += pkt->size;
+    stats->size_histogram[FFMIN (bucket, PACKET_QUEUE_HISTOGRAM_SIZE - 1)]++;
+
+    stats->max_nb_packets = FFMAX (stats->max_nb_packets, q->nb_packets);
+    stats->max_size = FFMAX (stats->max_size, q->size);
+    stats->max_duration = FFMAX (stats->max_duration, q->duration);
+}
+
+static void stats_get (PacketQueue *q, AVPacket *pkt)
+{
+    q->stats.nb_gets++;
+    q->stats.get_bytes += pkt->size;
+}
+
+static bool ring_stopped (PacketQueue *q)
+{
+    return __atomic_load_n (&q->stop_request, __ATOMIC_ACQUIRE);
+}
+
+// Wakes the other side only if it announced that it is going to sleep. The
+// fence pairs with the one in ring_wait so that either the sleeper sees the
+// new index or we see its flag.
+static void ring_wake (PacketQueue *q, int *waiting)
+{
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n (waiting, __ATOMIC_RELAXED))
+    {
+        SDL_LockMutex (q->mutex);
+        SDL_CondBroadcast (q->cond);
+        SDL_UnlockMutex (q->mutex);
+    }
+}
+
+static bool ring_full (PacketQueue *q)
+{
+    return q->tail - __atomic_load_n (&q->head, __ATOMIC_ACQUIRE)
+            >= q->ring_capacity
+        || queue_full (q);
+}
+
+static bool ring_empty (PacketQueue *q)
+{
+    return q->head == __atomic_load_n (&q->tail, __ATOMIC_ACQUIRE);
+}
+
+static bool put_interrupted (PacketQueue *q)
+{
+    return __atomic_load_n (&q->put_interrupted, __ATOMIC_ACQUIRE);
+}
+
+// the producer sleeps until there is room or somebody interrupts it
+static bool ring_put_blocked (PacketQueue *q)
+{
+    return ring_full (q) && !put_interrupted (q);
+}
+
+// Returns false once the deadline (in av_gettime units) has passed, a
+// negative deadline waits until signalled.
+static bool cond_wait_until (SDL_cond *cond, SDL_mutex *mutex, int64_t deadline)
+{
+    int64_t remaining;
+
+    if (deadline < 0)
+    {
+        SDL_CondWait (cond, mutex);
+        return true;
+    }
+
+    remaining = deadline - av_gettime ();
+    if (remaining <= 0)
+        return false;
+
+    // SDL counts in milliseconds, round up so we never give up early
+    SDL_CondWaitTimeout (cond, mutex, (remaining + 999) / 1000);
+
+    return true;
+}
+
+static void ring_wait (PacketQueue *q, int *waiting, bool (*busy) (PacketQueue *),
+                       int64_t deadline, int64_t *wait_time)
+{
+    int64_t start = av_gettime ();
+
+    SDL_LockMutex (q->mutex);
+
+    __atomic_store_n (waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+    while (!ring_stopped (q) && busy (q))
+    {
+        if (!cond_wait_until (q->cond, q->mutex, deadline))
+            break;
+    }
+
+    __atomic_store_n (waiting, 0, __ATOMIC_RELAXED);
+
+    SDL_UnlockMutex (q->mutex);
+
+    *wait_time += av_gettime () - start;
+}
+
+// Hands the payload over to dst and leaves src empty, so buffers travel from
+// producer to consumer without being copied or referenced twice.
+static void packet_move (AVPacket *dst, AVPacket *src)
+{
+    *dst = *src;
+
+    av_init_packet (src);
+    src->data = NULL;
+    src->size = 0;
+}
+
+static void ring_push (PacketQueue *q, AVPacket *pkt)
+{
+    AVPacket *slot = &q->ring[q->tail & (q->ring_capacity - 1)];
+
+    packet_move (slot, pkt);
+
+    __atomic_add_fetch (&q->nb_packets, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&q->size, slot->size, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&q->duration, slot->duration, __ATOMIC_RELAXED);
+
+    // the consumer may take the slot as soon as the tail moves
+    stats_put (q, slot);
+
+    __atomic_store_n (&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+}
+
+static void ring_pop (PacketQueue *q, AVPacket *pkt)
+{
+    *pkt = q->ring[q->head & (q->ring_capacity - 1)];
+
+    __atomic_sub_fetch (&q->nb_packets, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch (&q->size, pkt->size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch (&q->duration, pkt->duration, __ATOMIC_RELAXED);
+    __atomic_store_n (&q->head, q->head + 1, __ATOMIC_RELEASE);
+
+    stats_get (q, pkt);
+}
+
+static int ring_put_batch (PacketQueue *q, AVPacket *pkts, int nb_pkts)
+{
+    int i;
+
+    for (i = 0; i < nb_pkts; i++)
+    {
+        if (ring_full (q))
+        {
+            ring_wake (q, &q->consumer_waiting);
+            ring_wait (q, &q->producer_waiting, ring_put_blocked, -1,
+                       &q->stats.producer_wait_time);
+        }
+
+        if (ring_stopped (q))
+            break;
+
+        // still full, so the wait was interrupted
+        if (ring_full (q))
+        {
+            __atomic_store_n (&q->put_interrupted, false, __ATOMIC_RELAXED);
+            break;
+        }
+
+        ring_push (q, &pkts[i]);
+    }
+
+    ring_wake (q, &q->consumer_waiting);
+
+    return i;
+}
+
+static int ring_get_batch (PacketQueue *q, AVPacket *pkts, int max_pkts,
+                           int max_size, int64_t deadline)
+{
+    int n = 0, size = 0;
+
+    if (ring_stopped (q))
         return -1;
 
-    node->pkt = *pkt;
+    if (ring_empty (q))
+    {
+        if (deadline == 0)
+            return 0;
+
+        ring_wait (q, &q->consumer_waiting, ring_empty, deadline,
+                   &q->stats.consumer_wait_time);
+
+        if (ring_stopped (q))
+            return -1;
+    }
+
+    while (n < max_pkts && !ring_empty (q))
+    {
+        AVPacket *next = &q->ring[q->head & (q->ring_capacity - 1)];
+
+        if (n > 0 && max_size && size + next->size > max_size)
+            break;
+
+        size += next->size;
+        ring_pop (q, &pkts[n++]);
+    }
+
+    ring_wake (q, &q->producer_waiting);
+
+    return n;
+}
+
+static void list_append (PacketQueue *q, AVPacketList *node, AVPacket *pkt)
+{
+    packet_move (&node->pkt, pkt);
     node->next = NULL;
 
     if (!q->last_pkt)
@@ -36,20 +363,108 @@ int packet_queue_put (PacketQueue *q, AVPacket *pkt)
         q->last_pkt->next = node;
 
     q->last_pkt = node;
-    q->nb_packets++;
+    __atomic_store_n (&q->nb_packets, q->nb_packets + 1, __ATOMIC_RELAXED);
     q->size += node->pkt.size;
+    q->duration += node->pkt.duration;
+
+    stats_put (q, &node->pkt);
+}
+
+static AVPacketList *list_remove (PacketQueue *q)
+{
+    AVPacketList *node = q->first_pkt;
+
+    q->first_pkt = node->next;
+    if (!q->first_pkt)
+        q->last_pkt = NULL;
+    __atomic_store_n (&q->nb_packets, q->nb_packets - 1, __ATOMIC_RELAXED);
+    q->size -= node->pkt.size;
+    q->duration -= node->pkt.duration;
+
+    stats_get (q, &node->pkt);
+
+    return node;
+}
+
+int packet_queue_put (PacketQueue *q, AVPacket *pkt)
+{
+    return packet_queue_put_batch (q, pkt, 1) == 1 ? 0 : -1;
+}
+
+int packet_queue_put_batch (PacketQueue *q, AVPacket *pkts, int nb_pkts)
+{
+    AVPacketList *node;
+    int i;
+
+    if (q->stop_request)
+        return 0;
+
+    // refcounted packets are moved as they are, only packets still pointing
+    // into demuxer memory need a private copy
+    for (i = 0; i < nb_pkts; i++)
+    {
+        if (!pkts[i].buf && av_dup_packet (&pkts[i]) < 0)
+        {
+            nb_pkts = i;
+            break;
+        }
+    }
+
+    if (q->ring)
+        return ring_put_batch (q, pkts, nb_pkts);
+
+    SDL_LockMutex(q->mutex);
+
+    for (i = 0; i < nb_pkts; i++)
+    {
+        if (queue_full (q))
+        {
+            int64_t start = av_gettime ();
+
+            // let the consumer drain what is already queued
+            SDL_CondSignal (q->cond);
+
+            while (queue_full (q) && !q->stop_request && !put_interrupted (q))
+                SDL_CondWait (q->not_full, q->mutex);
+
+            q->stats.producer_wait_time += av_gettime () - start;
+        }
+
+        if (q->stop_request)
+            break;
+
+        if (queue_full (q))
+        {
+            __atomic_store_n (&q->put_interrupted, false, __ATOMIC_RELAXED);
+            break;
+        }
+
+        node = node_alloc (q);
+        if (!node)
+            break;
+
+        list_append (q, node, &pkts[i]);
+    }
 
     SDL_CondSignal (q->cond);
     SDL_UnlockMutex (q->mutex);
 
-    return 0;
+    return i;
 }
 
-int packet_queue_get (PacketQueue *q, AVPacket *pkt, bool block)
+// timeout is in microseconds, 0 does not block and a negative one waits
+// forever
+static int queue_get (PacketQueue *q, AVPacket *pkts, int max_pkts,
+                      int max_size, int64_t timeout)
 {
     AVPacketList *node;
+    int64_t deadline = timeout > 0 ? av_gettime () + timeout : timeout;
+    int size;
     int ret;
 
+    if (q->ring)
+        return ring_get_batch (q, pkts, max_pkts, max_size, deadline);
+
     SDL_LockMutex (q->mutex);
 
     for (;;)
@@ -60,27 +475,40 @@ int packet_queue_get (PacketQueue *q, AVPacket *pkt, bool block)
             break;
         }
 
-        node = q->first_pkt;
-        if (node)
+        if (q->first_pkt)
         {
-            q->first_pkt = node->next;
-            if (!q->first_pkt)
-                q->last_pkt = NULL;
-            q->nb_packets--;
-            q->size -= node->pkt.size;
-            *pkt = node->pkt;
-            av_free(node);
-            ret = 1;
+            ret = 0;
+            size = 0;
+
+            while (ret < max_pkts && q->first_pkt)
+            {
+                if (ret > 0 && max_size
+                        && size + q->first_pkt->pkt.size > max_size)
+                    break;
+
+                node = list_remove (q);
+                size += node->pkt.size;
+                pkts[ret++] = node->pkt;
+                node_free (q, node);
+            }
+
+            SDL_CondSignal (q->not_full);
             break;
         }
-        else if (!block)
+        else if (deadline == 0)
         {
             ret = 0;
             break;
         }
         else
         {
-            SDL_CondWait (q->cond, q->mutex);
+            int64_t start = av_gettime ();
+            bool waited = cond_wait_until (q->cond, q->mutex, deadline);
+
+            q->stats.consumer_wait_time += av_gettime () - start;
+
+            if (!waited)
+                deadline = 0;
         }
     }
 
@@ -89,24 +517,56 @@ int packet_queue_get (PacketQueue *q, AVPacket *pkt, bool block)
     return ret;
 }
 
+int packet_queue_get (PacketQueue *q, AVPacket *pkt, bool block)
+{
+    return queue_get (q, pkt, 1, 0, block ? -1 : 0);
+}
+
+int packet_queue_get_timeout (PacketQueue *q, AVPacket *pkt, int64_t timeout)
+{
+    return queue_get (q, pkt, 1, 0, FFMAX (timeout, 0));
+}
+
+int packet_queue_get_batch (PacketQueue *q, AVPacket *pkts, int max_pkts,
+                            int max_size, bool block)
+{
+    return queue_get (q, pkts, max_pkts, max_size, block ? -1 : 0);
+}
+
 void packet_queue_flush (PacketQueue *q)
 {
     AVPacketList *node, *next_node;
 
+    if (q->ring)
+    {
+        AVPacket pkt;
+
+        while (!ring_empty (q))
+        {
+            ring_pop (q, &pkt);
+            av_free_packet (&pkt);
+        }
+
+        ring_wake (q, &q->producer_waiting);
+        return;
+    }
+
     SDL_LockMutex (q->mutex);
 
     for (node = q->first_pkt; node != NULL; node = next_node)
     {
         next_node = node->next;
         av_free_packet (&node->pkt);
-        av_freep (&node);
+        node_free (q, node);
     }
 
     q->first_pkt = NULL;
     q->last_pkt = NULL;
-    q->nb_packets = 0;
+    __atomic_store_n (&q->nb_packets, 0, __ATOMIC_RELAXED);
     q->size = 0;
+    q->duration = 0;
 
+    SDL_CondBroadcast (q->not_full);
     SDL_UnlockMutex (q->mutex);
 }
 
@@ -114,8 +574,69 @@ void packet_queue_stop (PacketQueue *q)
 {
     SDL_LockMutex (q->mutex);
 
-    q->stop_request = true;
+    __atomic_store_n (&q->stop_request, true, __ATOMIC_RELEASE);
+
+    SDL_CondBroadcast (q->not_full);
+    SDL_CondBroadcast (q->cond);
+    SDL_UnlockMutex (q->mutex);
+}
+
+void packet_queue_interrupt_put (PacketQueue *q)
+{
+    SDL_LockMutex (q->mutex);
+
+    __atomic_store_n (&q->put_interrupted, true, __ATOMIC_RELEASE);
+
+    // a ring producer sleeps on cond, a list producer on not_full
+    SDL_CondBroadcast (q->not_full);
+    SDL_CondBroadcast (q->cond);
+    SDL_UnlockMutex (q->mutex);
+}
+
+int packet_queue_nb_packets (PacketQueue *q)
+{
+    return __atomic_load_n (&q->nb_packets, __ATOMIC_RELAXED);
+}
+
+void packet_queue_get_stats (PacketQueue *q, PacketQueueStats *stats)
+{
+    SDL_LockMutex (q->mutex);
+
+    *stats = q->stats;
+    stats->elapsed = av_gettime () - q->start_time;
 
-    SDL_CondSignal (q->cond);
     SDL_UnlockMutex (q->mutex);
 }
+
+void packet_queue_dump_stats (PacketQueue *q, const char *name)
+{
+    PacketQueueStats stats;
+    double seconds;
+    int i;
+
+    packet_queue_get_stats (q, &stats);
+
+    seconds = FFMAX (stats.elapsed, 1) / 1000000.0;
+
+    av_log (NULL, AV_LOG_INFO,
+            "%s: %d packets, %d bytes queued (max %d packets, %d bytes)\n",
+            name, q->nb_packets, q->size,
+            stats.max_nb_packets, stats.max_size);
+    av_log (NULL, AV_LOG_INFO,
+            "%s: put %.1f pkt/s %.1f kB/s, get %.1f pkt/s %.1f kB/s\n",
+            name, stats.nb_puts / seconds, stats.put_bytes / seconds / 1024,
+            stats.nb_gets / seconds, stats.get_bytes / seconds / 1024);
+    av_log (NULL, AV_LOG_INFO,
+            "%s: blocked producer %.3f s, consumer %.3f s, pool %u/%u\n",
+            name, stats.producer_wait_time / 1000000.0,
+            stats.consumer_wait_time / 1000000.0,
+            stats.pool_hits, stats.pool_misses);
+
+    av_log (NULL, AV_LOG_INFO, "%s: sizes", name);
+    for (i = 0; i < PACKET_QUEUE_HISTOGRAM_SIZE; i++)
+    {
+        if (stats.size_histogram[i])
+            av_log (NULL, AV_LOG_INFO, " %d:%u", 1 << i, stats.size_histogram[i]);
+    }
+    av_log (NULL, AV_LOG_INFO, "\n");
+}
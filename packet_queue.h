@@ -2,30 +2,118 @@
 #define PACKET_QUEUE_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef struct AVPacket AVPacket;
 typedef struct AVPacketList AVPacketList;
 typedef struct SDL_mutex SDL_mutex;
 typedef struct SDL_cond SDL_cond;
 
+#define PACKET_QUEUE_HISTOGRAM_SIZE 24
+
+typedef struct PacketQueueStats
+{
+    // high-water marks
+    int max_nb_packets;
+    int max_size;
+    int64_t max_duration;
+
+    int64_t nb_puts, nb_gets;
+    int64_t put_bytes, get_bytes;
+
+    // microseconds spent sleeping on a full or an empty queue
+    int64_t producer_wait_time;
+    int64_t consumer_wait_time;
+
+    // microseconds since init, to turn the counters into rates
+    int64_t elapsed;
+
+    // bucket n counts packets of [2^n, 2^(n+1)) bytes, the last one is open
+    unsigned size_histogram[PACKET_QUEUE_HISTOGRAM_SIZE];
+
+    unsigned pool_hits;
+    unsigned pool_misses;
+} PacketQueueStats;
+
 typedef struct PacketQueue
 {
     AVPacketList *first_pkt, *last_pkt;
     int nb_packets;
     int size;
+    int64_t duration;
     bool stop_request;
+    // one-shot, set by packet_queue_interrupt_put
+    bool put_interrupted;
     SDL_mutex *mutex;
     SDL_cond *cond;
+    SDL_cond *not_full;
+
+    // put blocks once any non-zero limit is reached, duration is in the
+    // time base of the queued stream
+    int max_packets;
+    int max_size;
+    int64_t max_duration;
+
+    // recycled list nodes, grown in slabs and released on destroy
+    AVPacketList *free_nodes;
+    AVPacketList *slabs;
+
+    // each counter is only written by one side, so ring mode needs no lock
+    PacketQueueStats stats;
+    int64_t start_time;
+
+    // ring mode: bounded single-producer/single-consumer buffer, the mutex
+    // is only taken when one side has to sleep
+    AVPacket *ring;
+    unsigned ring_capacity;
+    unsigned head, tail;
+    int consumer_waiting;
+    int producer_waiting;
 } PacketQueue;
 
 void packet_queue_init (PacketQueue *q);
 
+// capacity is rounded up to a power of two; put blocks while the ring is full
+int packet_queue_init_ring (PacketQueue *q, unsigned capacity);
+
+void packet_queue_destroy (PacketQueue *q);
+
+void packet_queue_set_capacity (PacketQueue *q, int max_packets, int max_size,
+                                int64_t max_duration);
+
+// Takes over the packet's buffer and leaves pkt empty; on failure pkt is
+// still owned by the caller.
 int packet_queue_put (PacketQueue *q, AVPacket *pkt);
 
 int packet_queue_get (PacketQueue *q, AVPacket *pkt, bool block);
 
+// waits at most timeout microseconds, returns 0 if nothing arrived in time
+int packet_queue_get_timeout (PacketQueue *q, AVPacket *pkt, int64_t timeout);
+
+// Moves up to nb_pkts packets with a single lock and wakeup, returns how many
+// were queued (0 once the queue is stopped); the rest stay owned by the caller.
+int packet_queue_put_batch (PacketQueue *q, AVPacket *pkts, int nb_pkts);
+
+// Takes up to max_pkts packets, stopping before max_size bytes (if non-zero)
+// would be exceeded, but always at least one.
+int packet_queue_get_batch (PacketQueue *q, AVPacket *pkts, int max_pkts,
+                            int max_size, bool block);
+
+// in ring mode must not race with packet_queue_get
 void packet_queue_flush (PacketQueue *q);
 
 void packet_queue_stop (PacketQueue *q);
 
+// Makes the next put that finds the queue full return with what it has
+// queued so far instead of waiting, including one that is waiting already.
+void packet_queue_interrupt_put (PacketQueue *q);
+
+// safe to call from any thread without holding the lock
+int packet_queue_nb_packets (PacketQueue *q);
+
+// a snapshot, exact in list mode and approximate in ring mode
+void packet_queue_get_stats (PacketQueue *q, PacketQueueStats *stats);
+
+void packet_queue_dump_stats (PacketQueue *q, const char *name);
+
 #endif // PACKET_QUEUE_H
@@ -0,0 +1,238 @@
+#include "seek_index.h"
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void seek_index_filename (char *buf, size_t size, const char *filename)
+{
+    snprintf (buf, size, "%s.idx", filename);
+}
+
+static int compare_entries (const void *a, const void *b)
+{
+    const SeekIndexEntry *x = a, *y = b;
+
+    return (x->pts > y->pts) - (x->pts < y->pts);
+}
+
+static int64_t file_size (const char *filename)
+{
+    struct stat st;
+
+    if (stat (filename, &st) < 0)
+        return AVERROR (errno);
+
+    return st.st_size;
+}
+
+static int write_index (const char *index_filename, SeekIndexHeader *header,
+                        SeekIndexEntry *entries)
+{
+    char tmp_filename[1024];
+    FILE *f;
+    int ret = 0;
+
+    // written aside and renamed, so a reader never maps a partial index
+    snprintf (tmp_filename, sizeof tmp_filename, "%s.tmp", index_filename);
+
+    f = fopen (tmp_filename, "wb");
+    if (!f)
+        return AVERROR (errno);
+
+    if (fwrite (header, sizeof *header, 1, f) != 1
+        || fwrite (entries, sizeof *entries, header->nb_entries, f)
+           != header->nb_entries)
+        ret = AVERROR (EIO);
+
+    if (fclose (f) != 0 && !ret)
+        ret = AVERROR (EIO);
+
+    if (!ret && rename (tmp_filename, index_filename) < 0)
+        ret = AVERROR (errno);
+    if (ret < 0)
+        unlink (tmp_filename);
+
+    return ret;
+}
+
+int seek_index_build (const char *filename, const char *index_filename)
+{
+    AVFormatContext *format_ctx = NULL;
+    AVStream *stream;
+    AVPacket pkt;
+    SeekIndexHeader header =
+    {
+        .magic = SEEK_INDEX_MAGIC,
+        .version = SEEK_INDEX_VERSION
+    };
+    SeekIndexEntry *entries = NULL, *tmp;
+    int nb_entries = 0, max_entries = 0, gop_size = 0;
+    int stream_index, ret;
+
+    av_init_packet (&pkt);
+
+    if ((ret = avformat_open_input (&format_ctx, filename, NULL, NULL)) < 0)
+        return ret;
+
+    if ((ret = avformat_find_stream_info (format_ctx, NULL)) < 0)
+        goto end;
+
+    stream_index = av_find_best_stream (format_ctx, AVMEDIA_TYPE_VIDEO,
+                                        -1, -1, NULL, 0);
+    if (stream_index < 0)
+    {
+        ret = stream_index;
+        goto end;
+    }
+
+    while (av_read_frame (format_ctx, &pkt) >= 0)
+    {
+        if (pkt.stream_index != stream_index)
+        {
+            av_free_packet (&pkt);
+            continue;
+        }
+
+        if ((pkt.flags & AV_PKT_FLAG_KEY) && pkt.pos >= 0
+            && pkt.pts != AV_NOPTS_VALUE)
+        {
+            if (nb_entries > 0)
+                entries[nb_entries - 1].gop_size = gop_size;
+
+            if (nb_entries == max_entries)
+            {
+                max_entries = FFMAX (256, max_entries * 2);
+                tmp = av_realloc (entries, max_entries * sizeof *entries);
+                if (!tmp)
+                {
+                    av_free_packet (&pkt);
+                    ret = AVERROR (ENOMEM);
+                    goto end;
+                }
+                entries = tmp;
+            }
+
+            memset (&entries[nb_entries], 0, sizeof *entries);
+            entries[nb_entries].pts = pkt.pts;
+            entries[nb_entries].pos = pkt.pos;
+            nb_entries++;
+            gop_size = 0;
+        }
+
+        gop_size++;
+        av_free_packet (&pkt);
+    }
+
+    if (nb_entries > 0)
+        entries[nb_entries - 1].gop_size = gop_size;
+
+    // transport streams do not always deliver keyframes in pts order
+    qsort (entries, nb_entries, sizeof *entries, compare_entries);
+
+    stream = format_ctx->streams[stream_index];
+    header.nb_entries = nb_entries;
+    header.stream_index = stream_index;
+    header.time_base_num = stream->time_base.num;
+    header.time_base_den = stream->time_base.den;
+    header.file_size = file_size (filename);
+    if (header.file_size < 0)
+    {
+        ret = header.file_size;
+        goto end;
+    }
+
+    ret = write_index (index_filename, &header, entries);
+
+end:
+    av_free (entries);
+    avformat_close_input (&format_ctx);
+
+    return ret;
+}
+
+int seek_index_open (SeekIndex *index, const char *index_filename,
+                     const char *filename)
+{
+    const SeekIndexHeader *header;
+    struct stat st;
+    int fd;
+
+    memset (index, 0, sizeof *index);
+
+    fd = open (index_filename, O_RDONLY);
+    if (fd < 0)
+        return AVERROR (errno);
+
+    if (fstat (fd, &st) < 0 || st.st_size < (off_t)sizeof *header)
+    {
+        close (fd);
+        return AVERROR_INVALIDDATA;
+    }
+
+    index->map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (index->map == MAP_FAILED)
+    {
+        index->map = NULL;
+        return AVERROR (errno);
+    }
+    index->map_size = st.st_size;
+
+    header = index->map;
+    if (memcmp (header->magic, SEEK_INDEX_MAGIC, 4)
+        || header->version != SEEK_INDEX_VERSION
+        || index->map_size != sizeof *header
+                              + header->nb_entries * sizeof *index->entries
+        || header->file_size != file_size (filename))
+    {
+        seek_index_close (index);
+        return AVERROR_INVALIDDATA;
+    }
+
+    index->header = header;
+    index->entries = (const SeekIndexEntry *)(header + 1);
+    index->nb_entries = header->nb_entries;
+
+    return 0;
+}
+
+void seek_index_close (SeekIndex *index)
+{
+    if (index->map)
+        munmap (index->map, index->map_size);
+
+    memset (index, 0, sizeof *index);
+}
+
+const SeekIndexEntry *seek_index_find (const SeekIndex *index, int64_t pts,
+                                       bool backward)
+{
+    int lo = 0, hi = index->nb_entries;
+
+    // first entry with entries[lo].pts >= pts
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+
+        if (index->entries[mid].pts < pts)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (backward)
+    {
+        if (lo < index->nb_entries && index->entries[lo].pts == pts)
+            return &index->entries[lo];
+        return lo > 0 ? &index->entries[lo - 1] : NULL;
+    }
+
+    return lo < index->nb_entries ? &index->entries[lo] : NULL;
+}
@@ -0,0 +1,61 @@
+#ifndef SEEK_INDEX_H
+#define SEEK_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SEEK_INDEX_MAGIC "FFSI"
+#define SEEK_INDEX_VERSION 1
+
+// The sidecar file is the header followed by the entries sorted by pts, in
+// native byte order, so it can be mapped and searched in place.
+typedef struct SeekIndexHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t nb_entries;
+    int32_t stream_index;
+    int32_t time_base_num;
+    int32_t time_base_den;
+    // size of the indexed file, a mismatch means the index is stale
+    int64_t file_size;
+} SeekIndexHeader;
+
+typedef struct SeekIndexEntry
+{
+    int64_t pts; // in the stream time base
+    int64_t pos; // byte offset of the keyframe packet
+    int32_t gop_size; // packets up to the next keyframe
+    int32_t reserved;
+} SeekIndexEntry;
+
+typedef struct SeekIndex
+{
+    const SeekIndexHeader *header;
+    const SeekIndexEntry *entries;
+    int nb_entries;
+
+    void *map;
+    size_t map_size;
+} SeekIndex;
+
+// "<filename>.idx"
+void seek_index_filename (char *buf, size_t size, const char *filename);
+
+// Scans the best video stream of filename once without decoding and writes
+// the keyframes to index_filename.
+int seek_index_build (const char *filename, const char *index_filename);
+
+// maps index_filename, fails if it does not match the current filename
+int seek_index_open (SeekIndex *index, const char *index_filename,
+                     const char *filename);
+
+void seek_index_close (SeekIndex *index);
+
+// The last keyframe at or before pts if backward, the first one at or after
+// it otherwise; NULL if there is none.
+const SeekIndexEntry *seek_index_find (const SeekIndex *index, int64_t pts,
+                                       bool backward);
+
+#endif // SEEK_INDEX_H
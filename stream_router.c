@@ -0,0 +1,203 @@
+#include "stream_router.h"
+#include <libavcodec/avcodec.h>
+#include <SDL.h>
+#include <SDL_thread.h>
+
+int stream_router_init (StreamRouter *r, int nb_streams)
+{
+    memset (r, 0, sizeof *r);
+
+    r->routes = av_mallocz (nb_streams * sizeof *r->routes);
+    if (!r->routes)
+        return -1;
+
+    r->nb_routes = nb_streams;
+
+    return 0;
+}
+
+// Whatever an interrupted put leaves behind stays staged for the next try,
+// except packets the queue could not copy out of demuxer memory.
+static void route_publish (StreamRoute *route)
+{
+    int i, queued, n = 0;
+
+    if (!route->nb_staged)
+        return;
+
+    queued = packet_queue_put_batch (route->queue, route->stage,
+                                     route->nb_staged);
+
+    for (i = queued; i < route->nb_staged; i++)
+    {
+        if (route->stage[i].buf)
+            route->stage[n++] = route->stage[i];
+        else
+            av_free_packet (&route->stage[i]);
+    }
+
+    route->nb_staged = n;
+}
+
+void stream_router_destroy (StreamRouter *r)
+{
+    StreamRoute *route;
+    int i;
+
+    stream_router_stop (r);
+
+    for (i = 0; i < r->nb_routes; i++)
+    {
+        route = &r->routes[i];
+
+        while (route->nb_staged > 0)
+            av_free_packet (&route->stage[--route->nb_staged]);
+        av_freep (&route->stage);
+
+        if (route->thread)
+            SDL_WaitThread (route->thread, NULL);
+        if (route->worker)
+            packet_queue_destroy (&route->worker_queue);
+    }
+
+    av_freep (&r->routes);
+    r->nb_routes = 0;
+}
+
+int stream_router_set_queue (StreamRouter *r, int stream_index, PacketQueue *q)
+{
+    StreamRoute *route;
+
+    if (stream_index < 0 || stream_index >= r->nb_routes)
+        return -1;
+
+    route = &r->routes[stream_index];
+    if (route->queue)
+        return -1;
+
+    route->stage = av_malloc (STREAM_ROUTER_STAGE_SIZE * sizeof *route->stage);
+    if (!route->stage)
+        return -1;
+
+    route->queue = q;
+
+    return 0;
+}
+
+static int worker_thread (void *arg)
+{
+    StreamRoute *route = arg;
+
+    return route->worker (route->queue, route->opaque);
+}
+
+int stream_router_add_worker (StreamRouter *r, int stream_index,
+                              StreamWorkerFunc func, void *opaque)
+{
+    StreamRoute *route;
+
+    if (stream_index < 0 || stream_index >= r->nb_routes)
+        return -1;
+
+    route = &r->routes[stream_index];
+
+    packet_queue_init (&route->worker_queue);
+    if (stream_router_set_queue (r, stream_index, &route->worker_queue) < 0)
+    {
+        packet_queue_destroy (&route->worker_queue);
+        return -1;
+    }
+
+    route->worker = func;
+    route->opaque = opaque;
+    route->thread = SDL_CreateThread (worker_thread, route);
+    if (!route->thread)
+        return -1;
+
+    return 0;
+}
+
+int stream_router_dispatch (StreamRouter *r, AVPacket *pkt)
+{
+    StreamRoute *route;
+    bool owned;
+
+    if (pkt->stream_index < 0 || pkt->stream_index >= r->nb_routes)
+        return 0;
+
+    route = &r->routes[pkt->stream_index];
+    if (!route->queue)
+        return 0;
+
+    // an interrupted publish may have left the stage full
+    if (route->nb_staged == STREAM_ROUTER_STAGE_SIZE)
+    {
+        route_publish (route);
+        if (route->nb_staged == STREAM_ROUTER_STAGE_SIZE)
+            return AVERROR (EAGAIN);
+    }
+
+    // a packet without a buffer points into demuxer memory that the next read
+    // may reuse, so it goes out now and the queue makes its own copy
+    owned = pkt->buf != NULL;
+
+    route->stage[route->nb_staged++] = *pkt;
+    av_init_packet (pkt);
+    pkt->data = NULL;
+    pkt->size = 0;
+
+    // publish early while the queue is running low
+    if (!owned || route->nb_staged == STREAM_ROUTER_STAGE_SIZE
+            || packet_queue_nb_packets (route->queue)
+                   < STREAM_ROUTER_STAGE_SIZE)
+        route_publish (route);
+
+    return 1;
+}
+
+void stream_router_publish (StreamRouter *r)
+{
+    int i;
+
+    for (i = 0; i < r->nb_routes; i++)
+        route_publish (&r->routes[i]);
+}
+
+void stream_router_flush (StreamRouter *r)
+{
+    StreamRoute *route;
+    int i;
+
+    for (i = 0; i < r->nb_routes; i++)
+    {
+        route = &r->routes[i];
+
+        while (route->nb_staged > 0)
+            av_free_packet (&route->stage[--route->nb_staged]);
+
+        if (route->queue)
+            packet_queue_flush (route->queue);
+    }
+}
+
+void stream_router_stop (StreamRouter *r)
+{
+    int i;
+
+    for (i = 0; i < r->nb_routes; i++)
+    {
+        if (r->routes[i].queue)
+            packet_queue_stop (r->routes[i].queue);
+    }
+}
+
+void stream_router_interrupt (StreamRouter *r)
+{
+    int i;
+
+    for (i = 0; i < r->nb_routes; i++)
+    {
+        if (r->routes[i].queue)
+            packet_queue_interrupt_put (r->routes[i].queue);
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef STREAM_ROUTER_H
+#define STREAM_ROUTER_H
+
+#include "packet_queue.h"
+
+#define STREAM_ROUTER_STAGE_SIZE 8
+
+typedef struct SDL_Thread SDL_Thread;
+
+typedef int (*StreamWorkerFunc) (PacketQueue *q, void *opaque);
+
+typedef struct StreamRoute
+{
+    PacketQueue *queue;
+
+    // packets held back so they reach the queue in batches
+    AVPacket *stage;
+    int nb_staged;
+
+    // set for routes that run their own decoder thread on their own queue
+    PacketQueue worker_queue;
+    StreamWorkerFunc worker;
+    void *opaque;
+    SDL_Thread *thread;
+} StreamRoute;
+
+// Maps stream indices straight to their packet queues, so dispatch costs one
+// array lookup however many streams are consumed.
+typedef struct StreamRouter
+{
+    StreamRoute *routes;
+    int nb_routes;
+} StreamRouter;
+
+int stream_router_init (StreamRouter *r, int nb_streams);
+
+// stops and joins the workers, packets still staged are freed
+void stream_router_destroy (StreamRouter *r);
+
+int stream_router_set_queue (StreamRouter *r, int stream_index, PacketQueue *q);
+
+// starts func on a thread of its own, reading from a queue owned by the route
+int stream_router_add_worker (StreamRouter *r, int stream_index,
+                              StreamWorkerFunc func, void *opaque);
+
+// Returns 1 if the packet was taken, 0 if nobody consumes its stream and
+// AVERROR(EAGAIN) if an interrupted put left no room to stage it; in the last
+// two cases the packet still belongs to the caller. Copying packets that do
+// not own their data is left to the queue.
+int stream_router_dispatch (StreamRouter *r, AVPacket *pkt);
+
+// pushes all staged packets to their queues, unless interrupted
+void stream_router_publish (StreamRouter *r);
+
+void stream_router_flush (StreamRouter *r);
+
+void stream_router_stop (StreamRouter *r);
+
+// makes a dispatch waiting on a full queue give up, e.g. for a pending seek;
+// the packets it could not queue stay staged until published or flushed
+void stream_router_interrupt (StreamRouter *r);
+
+#endif // STREAM_ROUTER_H
@@ -0,0 +1,116 @@
+#include "sync_clock.h"
+#include <libavutil/common.h>
+#include <SDL.h>
+#include <time.h>
+
+#define NS_PER_SEC INT64_C(1000000000)
+
+static int64_t clock_at (const SyncClock *c, int64_t now)
+{
+    if (c->paused)
+        return c->pts;
+
+    return c->pts + (int64_t)((now - c->last_updated) * c->rate
+                              * (1.0 + c->drift));
+}
+
+// keeps the time shown so far when the speed changes, called locked
+static void reanchor (SyncClock *c)
+{
+    int64_t now = sync_clock_now ();
+
+    c->pts = clock_at (c, now);
+    c->last_updated = now;
+}
+
+static void set_locked (SyncClock *c, int64_t pts)
+{
+    c->pts = pts;
+    c->last_updated = sync_clock_now ();
+    c->drift = 0.0;
+}
+
+int64_t sync_clock_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+void sync_clock_init (SyncClock *c)
+{
+    c->pts = 0;
+    c->last_updated = sync_clock_now ();
+    c->rate = 1.0;
+    c->drift = 0.0;
+    c->paused = false;
+    c->mutex = SDL_CreateMutex ();
+}
+
+void sync_clock_destroy (SyncClock *c)
+{
+    SDL_DestroyMutex (c->mutex);
+    c->mutex = NULL;
+}
+
+int64_t sync_clock_get (const SyncClock *c)
+{
+    int64_t pts;
+
+    SDL_LockMutex (c->mutex);
+    pts = clock_at (c, sync_clock_now ());
+    SDL_UnlockMutex (c->mutex);
+
+    return pts;
+}
+
+void sync_clock_set (SyncClock *c, int64_t pts)
+{
+    SDL_LockMutex (c->mutex);
+    set_locked (c, pts);
+    SDL_UnlockMutex (c->mutex);
+}
+
+void sync_clock_set_paused (SyncClock *c, bool paused)
+{
+    SDL_LockMutex (c->mutex);
+    if (paused != c->paused)
+    {
+        // resuming starts from the paused time, not from where it would have
+        // been
+        reanchor (c);
+        c->paused = paused;
+    }
+    SDL_UnlockMutex (c->mutex);
+}
+
+void sync_clock_set_rate (SyncClock *c, double rate)
+{
+    SDL_LockMutex (c->mutex);
+    reanchor (c);
+    c->rate = rate;
+    SDL_UnlockMutex (c->mutex);
+}
+
+void sync_clock_correct (SyncClock *c, int64_t reference, int64_t max_drift)
+{
+    int64_t now, diff;
+
+    SDL_LockMutex (c->mutex);
+    now = sync_clock_now ();
+    diff = reference - clock_at (c, now);
+    if (FFABS (diff) > max_drift)
+    {
+        set_locked (c, reference);
+    }
+    else
+    {
+        c->pts = clock_at (c, now);
+        c->last_updated = now;
+        c->drift = av_clipd ((double)diff / NS_PER_SEC, -SYNC_CLOCK_MAX_SLEW,
+                             SYNC_CLOCK_MAX_SLEW);
+    }
+    SDL_UnlockMutex (c->mutex);
+}
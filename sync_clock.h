@@ -0,0 +1,48 @@
+#ifndef SYNC_CLOCK_H
+#define SYNC_CLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct SDL_mutex SDL_mutex;
+
+// largest relative speed-up or slow-down used to absorb drift
+#define SYNC_CLOCK_MAX_SLEW 0.005
+
+// A media clock in nanoseconds that advances from its last anchor at rate
+// times real time on CLOCK_MONOTONIC, so wall clock steps and NTP slews do
+// not move it. Every call takes the clock's mutex, so it can be set from the
+// audio callback and read from the main thread.
+typedef struct SyncClock
+{
+    int64_t pts; // media time at the anchor
+    int64_t last_updated; // sync_clock_now () at the anchor
+    double rate; // playback speed, 1.0 is real time
+    double drift; // relative correction on top of rate
+    bool paused;
+    SDL_mutex *mutex;
+} SyncClock;
+
+// CLOCK_MONOTONIC in nanoseconds
+int64_t sync_clock_now (void);
+
+// starts at 0, running at normal speed
+void sync_clock_init (SyncClock *c);
+
+void sync_clock_destroy (SyncClock *c);
+
+int64_t sync_clock_get (const SyncClock *c);
+
+// re-anchors at pts and drops any drift correction
+void sync_clock_set (SyncClock *c, int64_t pts);
+
+void sync_clock_set_paused (SyncClock *c, bool paused);
+
+void sync_clock_set_rate (SyncClock *c, double rate);
+
+// Pulls the clock towards reference by running it up to SYNC_CLOCK_MAX_SLEW
+// faster or slower, aiming to close the gap within a second. A clock more than
+// max_drift away is set to reference outright.
+void sync_clock_correct (SyncClock *c, int64_t reference, int64_t max_drift);
+
+#endif // SYNC_CLOCK_H
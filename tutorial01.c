@@ -1,7 +1,31 @@
+#include "async_writer.h"
+#include "decoder.h"
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+#include <SDL.h>
+#include <SDL_thread.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// rows per writev, as many as the kernel takes in one call; 4K 4:2:0 with
+// padded lines then needs 5 calls a frame instead of 68
+#ifdef IOV_MAX
+#define IOV_BATCH IOV_MAX
+#else
+#define IOV_BATCH 1024
+#endif
+#define ASYNC_BUFFER_SIZE (4 * 1024 * 1024)
 
 typedef struct
 {
@@ -11,13 +35,224 @@ typedef struct
     AVFrame *frame;
     int got_frame;
 
-    uint8_t *data[4];
-    int linesize[4];
-    int bufsize;
+    int fd;
+
+    // segment mode: frames go to their place in the file with pwrite. With
+    // frame_pts set a frame belongs at the rank of its pts in that sorted
+    // list, and only ranks in [first_frame, end_frame) are written; without
+    // it frames follow each other from offset on. Frames whose rank falls
+    // outside the range are counted in nb_misplaced.
+    int64_t offset;
+    int nb_frames;
+    int frame_size;
+    const int64_t *frame_pts;
+    int nb_frame_pts;
+    int first_frame, end_frame;
+    int nb_misplaced;
+
+    // async mode: frames are copied into the writer's buffers and written
+    // out by its thread while the next one decodes
+    bool async;
+    AsyncWriter writer;
 
-    FILE *file;
+    // benchmark mode: decode into a null sink and time it
+    bool bench;
+    int64_t decode_time;
+    int64_t total_decode_time;
+    int64_t input_bytes;
+    int64_t *latencies;
+    int nb_latencies;
+    int max_latencies;
 } DecodingContext;
 
+// writes at *offset and advances it if offset is set, sequentially otherwise
+static int write_iov (int fd, struct iovec *iov, int nb_iov, int64_t *offset)
+{
+    ssize_t written;
+
+    while (nb_iov > 0)
+    {
+        if (offset)
+            written = pwritev (fd, iov, nb_iov, *offset);
+        else
+            written = writev (fd, iov, nb_iov);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return AVERROR (errno);
+        }
+
+        if (offset)
+            *offset += written;
+
+        // skip what went out and resume in the middle of a partial vector
+        while (nb_iov > 0 && written >= (ssize_t)iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            nb_iov--;
+        }
+
+        if (nb_iov > 0)
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    return 0;
+}
+
+static int output_iov (DecodingContext *ctx, struct iovec *iov, int nb_iov)
+{
+    int i, ret;
+
+    if (!ctx->async)
+        return write_iov (ctx->fd, iov, nb_iov,
+                          ctx->offset >= 0 ? &ctx->offset : NULL);
+
+    for (i = 0; i < nb_iov; i++)
+    {
+        if ((ret = async_writer_write (&ctx->writer, iov[i].iov_base,
+                                       iov[i].iov_len)) < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+// Writes the frame packed, straight from the decoder's planes, so in sync
+// mode the rows are never copied into an intermediate buffer.
+static int write_frame (DecodingContext *ctx, AVFrame *frame)
+{
+    AVCodecContext *codec = ctx->codec;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get (codec->pix_fmt);
+    struct iovec iov[IOV_BATCH];
+    int widths[4];
+    int plane, y, h, nb_iov = 0, ret;
+
+    if (!desc || av_image_fill_linesizes (widths, codec->pix_fmt,
+                                          codec->width) < 0)
+        return AVERROR (EINVAL);
+
+    for (plane = 0; plane < 4 && frame->data[plane]; plane++)
+    {
+        if (plane == 1 && (desc->flags & AV_PIX_FMT_FLAG_PAL))
+        {
+            widths[plane] = 256 * 4;
+            h = 1;
+        }
+        else if (plane == 1 || plane == 2)
+        {
+            h = -((-codec->height) >> desc->log2_chroma_h);
+        }
+        else
+        {
+            h = codec->height;
+        }
+
+        if (widths[plane] <= 0)
+            break;
+
+        // a plane without padding goes out as one vector
+        if (frame->linesize[plane] == widths[plane])
+        {
+            widths[plane] *= h;
+            h = 1;
+        }
+
+        for (y = 0; y < h; y++)
+        {
+            iov[nb_iov].iov_base = frame->data[plane] + y * frame->linesize[plane];
+            iov[nb_iov].iov_len = widths[plane];
+
+            if (++nb_iov == IOV_BATCH)
+            {
+                if ((ret = output_iov (ctx, iov, nb_iov)) < 0)
+                    return ret;
+                nb_iov = 0;
+            }
+        }
+    }
+
+    return output_iov (ctx, iov, nb_iov);
+}
+
+static int record_latency (DecodingContext *ctx)
+{
+    if (ctx->nb_latencies == ctx->max_latencies)
+    {
+        int64_t *latencies;
+        int n = FFMAX (1024, ctx->max_latencies * 2);
+
+        latencies = av_realloc (ctx->latencies, n * sizeof *latencies);
+        if (!latencies)
+            return AVERROR (ENOMEM);
+
+        ctx->latencies = latencies;
+        ctx->max_latencies = n;
+    }
+
+    // time spent in the decoder since the previous frame came out
+    ctx->latencies[ctx->nb_latencies++] = ctx->decode_time;
+    ctx->decode_time = 0;
+
+    return 0;
+}
+
+static int compare_int64 (const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void print_bench_report (DecodingContext *ctx, int64_t elapsed)
+{
+    int64_t *lat = ctx->latencies;
+    int n = ctx->nb_latencies;
+    double seconds = FFMAX (elapsed, 1) / 1000000.0;
+    double frame_mb = avpicture_get_size (ctx->codec->pix_fmt, ctx->codec->width,
+                                          ctx->codec->height) / (1024.0 * 1024.0);
+
+    if (n == 0)
+    {
+        av_log (NULL, AV_LOG_INFO, "No frames decoded\n");
+        return;
+    }
+
+    qsort (lat, n, sizeof *lat, compare_int64);
+
+    av_log (NULL, AV_LOG_INFO, "%d frames in %.3f s: %.1f fps, "
+            "input %.1f MB/s, output %.1f MB/s, decoder busy %.1f%%\n",
+            n, seconds, n / seconds,
+            ctx->input_bytes / (1024.0 * 1024.0) / seconds,
+            frame_mb * n / seconds,
+            100.0 * ctx->total_decode_time / FFMAX (elapsed, 1));
+    av_log (NULL, AV_LOG_INFO, "decode latency us: p50 %"PRId64" p90 %"PRId64
+            " p99 %"PRId64" max %"PRId64"\n",
+            lat[n / 2], lat[(int64_t)n * 90 / 100], lat[(int64_t)n * 99 / 100],
+            lat[n - 1]);
+}
+
+// the position of pts in display order, -1 if no packet carried it
+static int frame_rank (const int64_t *sorted_pts, int nb_pts, int64_t pts)
+{
+    int lo = 0, hi = nb_pts, mid;
+
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (sorted_pts[mid] < pts)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo < nb_pts && sorted_pts[lo] == pts ? lo : -1;
+}
+
 static int process_packet(AVPacket *pkt, DecodingContext *ctx)
 {
     AVCodecContext *codec = ctx->codec;
@@ -25,35 +260,540 @@ static int process_packet(AVPacket *pkt, DecodingContext *ctx)
 
     if (pkt->stream_index == ctx->stream_index)
     {
+        int64_t start = av_gettime ();
+
         if (avcodec_decode_video2(codec, frame, &ctx->got_frame, pkt) < 0)
         {
             av_log (NULL, AV_LOG_ERROR, "Error decoding video frame\n");
             return -1;
         }
 
-        if (ctx->got_frame)
+        start = av_gettime () - start;
+        ctx->decode_time += start;
+        ctx->total_decode_time += start;
+        ctx->input_bytes += pkt->size;
+
+        if (ctx->got_frame && ctx->bench)
+        {
+            return record_latency (ctx);
+        }
+        else if (ctx->got_frame)
+        {
+            if (ctx->frame_pts)
+            {
+                int rank = frame_rank (ctx->frame_pts, ctx->nb_frame_pts,
+                                       frame->pkt_pts);
+
+                // never spill into the range of another segment
+                if (rank < ctx->first_frame || rank >= ctx->end_frame)
+                {
+                    ctx->nb_misplaced++;
+                    return 0;
+                }
+
+                ctx->offset = (int64_t)rank * ctx->frame_size;
+            }
+
+            if (write_frame (ctx, frame) < 0)
+            {
+                av_log (NULL, AV_LOG_ERROR, "Error writing video frame\n");
+                return -1;
+            }
+            ctx->nb_frames++;
+        }
+    }
+
+    return 0;
+}
+
+typedef struct Segment
+{
+    const char *filename;
+    int fd;
+    int frame_size;
+    int thread_count, thread_type;
+
+    // decodes the packets from the keyframe at start_ts (from the beginning
+    // if AV_NOPTS_VALUE) up to the one at end_ts (to the end if
+    // AV_NOPTS_VALUE), which make up the frames of display rank first_frame
+    // to end_frame; frame_pts is NULL when the stream is decoded serially
+    int64_t start_ts, end_ts;
+    const int64_t *frame_pts;
+    int nb_frame_pts;
+    int first_frame, end_frame;
+
+    SDL_Thread *thread;
+    int ret;
+    // set when the frames did not fill the ranks one to one
+    bool mismatched;
+} Segment;
+
+typedef struct Keyframe
+{
+    int64_t ts;
+    int index;
+} Keyframe;
+
+static int64_t packet_ts (AVPacket *pkt)
+{
+    return pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+}
+
+// avcodec_open2 and avcodec_close must be serialized across threads
+static int lock_manager (void **mutex, enum AVLockOp op)
+{
+    switch (op)
+    {
+    case AV_LOCK_CREATE:
+        *mutex = SDL_CreateMutex ();
+        return !*mutex;
+    case AV_LOCK_OBTAIN:
+        return SDL_LockMutex (*mutex) != 0;
+    case AV_LOCK_RELEASE:
+        return SDL_UnlockMutex (*mutex) != 0;
+    case AV_LOCK_DESTROY:
+        SDL_DestroyMutex (*mutex);
+        return 0;
+    }
+
+    return 1;
+}
+
+// makes room for one more element, doubling the allocation when it is full
+static int grow_array (void **array, int *max, int n, size_t size)
+{
+    void *tmp;
+
+    if (n < *max)
+        return 0;
+
+    tmp = av_realloc (*array, FFMAX (64, *max * 2) * size);
+    if (!tmp)
+        return AVERROR (ENOMEM);
+
+    *array = tmp;
+    *max = FFMAX (64, *max * 2);
+
+    return 0;
+}
+
+// Reads through the stream once without decoding to find where the keyframes
+// are, how many packets precede each of them and the pts of every packet in
+// decode order.
+static int scan_keyframes (AVFormatContext *format_ctx, int stream_index,
+                           Keyframe **keyframes, int *nb_keyframes,
+                           int64_t **packet_pts, int *nb_packets)
+{
+    AVPacket pkt;
+    Keyframe *list = NULL;
+    int64_t *pts = NULL;
+    int n = 0, max = 0, index = 0, max_pts = 0, ret = 0;
+
+    av_init_packet (&pkt);
+
+    while (av_read_frame (format_ctx, &pkt) >= 0)
+    {
+        if (pkt.stream_index == stream_index)
+        {
+            if ((ret = grow_array ((void **)&pts, &max_pts, index,
+                                   sizeof *pts)) < 0)
+            {
+                av_free_packet (&pkt);
+                break;
+            }
+
+            pts[index] = pkt.pts;
+
+            if ((pkt.flags & AV_PKT_FLAG_KEY) && index > 0
+                && packet_ts (&pkt) != AV_NOPTS_VALUE)
+            {
+                if ((ret = grow_array ((void **)&list, &max, n,
+                                       sizeof *list)) < 0)
+                {
+                    av_free_packet (&pkt);
+                    break;
+                }
+
+                list[n].ts = packet_ts (&pkt);
+                list[n].index = index;
+                n++;
+            }
+
+            index++;
+        }
+
+        av_free_packet (&pkt);
+    }
+
+    *keyframes = list;
+    *nb_keyframes = n;
+    *packet_pts = pts;
+    *nb_packets = index;
+
+    return ret;
+}
+
+static int decode_segment (void *arg)
+{
+    Segment *seg = arg;
+    DecodingContext ctx =
+    {
+        .fd = seg->fd,
+        .offset = 0,
+        .frame_size = seg->frame_size,
+        .frame_pts = seg->frame_pts,
+        .nb_frame_pts = seg->nb_frame_pts,
+        .first_frame = seg->first_frame,
+        .end_frame = seg->end_frame
+    };
+    AVFormatContext *format_ctx = NULL;
+    AVCodec *decoder = NULL;
+    AVPacket pkt;
+    bool started = seg->start_ts == AV_NOPTS_VALUE;
+
+    seg->ret = -1;
+    av_init_packet (&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+
+    if (avformat_open_input (&format_ctx, seg->filename, NULL, NULL) < 0
+        || avformat_find_stream_info (format_ctx, NULL) < 0)
+    {
+        av_log (NULL, AV_LOG_ERROR, "Could not open input file\n");
+        goto end;
+    }
+
+    ctx.stream_index = av_find_best_stream (format_ctx, AVMEDIA_TYPE_VIDEO,
+                                            -1, -1, &decoder, 0);
+    if (ctx.stream_index < 0)
+        goto end;
+
+    ctx.codec = format_ctx->streams[ctx.stream_index]->codec;
+    if (decoder_open (ctx.codec, decoder, seg->thread_count,
+                      seg->thread_type) < 0)
+    {
+        av_log (NULL, AV_LOG_ERROR, "Could not open codec\n");
+        ctx.codec = NULL;
+        goto end;
+    }
+
+    ctx.frame = avcodec_alloc_frame ();
+    if (!ctx.frame)
+        goto end;
+
+    if (!started && av_seek_frame (format_ctx, ctx.stream_index, seg->start_ts,
+                                   AVSEEK_FLAG_BACKWARD) < 0)
+    {
+        av_log (NULL, AV_LOG_ERROR, "Could not seek to segment at frame %d\n",
+                seg->first_frame);
+        goto end;
+    }
+
+    while (av_read_frame (format_ctx, &pkt) >= 0)
+    {
+        if (pkt.stream_index == ctx.stream_index)
         {
-            av_image_copy(ctx->data, ctx->linesize,
-                          (const uint8_t **)frame->data, frame->linesize,
-                          codec->pix_fmt, codec->width, codec->height);
+            // the seek may land on an earlier keyframe
+            if (!started && packet_ts (&pkt) == seg->start_ts)
+                started = true;
 
-            fwrite(ctx->data[0], 1, ctx->bufsize, ctx->file);
+            if (started && seg->end_ts != AV_NOPTS_VALUE
+                && packet_ts (&pkt) == seg->end_ts)
+                break;
         }
+
+        if (started && process_packet (&pkt, &ctx) < 0)
+            goto end;
+
+        av_free_packet (&pkt);
     }
 
+    av_free_packet (&pkt);
+
+    // flush cached frames
+    pkt.data = NULL;
+    pkt.size = 0;
+    pkt.stream_index = ctx.stream_index;
+    do
+    {
+        if (process_packet (&pkt, &ctx) < 0)
+            goto end;
+    }
+    while (ctx.got_frame);
+
+    // packets holding several frames, or frames without a packet pts of
+    // their own, leave gaps or collide with other frames
+    if (seg->frame_pts && (ctx.nb_misplaced > 0
+                           || ctx.nb_frames != seg->end_frame - seg->first_frame))
+        seg->mismatched = true;
+
+    seg->ret = 0;
+
+end:
+    av_free_packet (&pkt);
+    av_free (ctx.frame);
+    if (ctx.codec)
+        avcodec_close (ctx.codec);
+    if (format_ctx)
+        avformat_close_input (&format_ctx);
+
     return 0;
 }
 
+// A keyframe starts a range that decodes on its own only if nothing before it
+// is shown after it and nothing after it is shown before it, which rules out
+// open GOPs whose leading pictures reference the previous one. It also makes
+// the keyframe's display rank equal to its decode index. Returns false if the
+// pts are missing or repeat, then frames cannot be placed by pts at all.
+static bool find_independent_keyframes (const int64_t *pts, int nb_packets,
+                                        Keyframe *keyframes, int *nb_keyframes,
+                                        int64_t *sorted_pts)
+{
+    int64_t *suffix_min = sorted_pts, prefix_max = INT64_MIN;
+    int i, k, n = 0;
+
+    for (i = nb_packets - 1; i >= 0; i--)
+    {
+        if (pts[i] == AV_NOPTS_VALUE)
+            return false;
+        suffix_min[i] = i + 1 < nb_packets ? FFMIN (pts[i], suffix_min[i + 1])
+                                           : pts[i];
+    }
+
+    for (i = 0, k = 0; i < nb_packets && k < *nb_keyframes; i++)
+    {
+        if (keyframes[k].index == i)
+        {
+            if (prefix_max < pts[i] && suffix_min[i] == pts[i])
+                keyframes[n++] = keyframes[k];
+            k++;
+        }
+
+        prefix_max = FFMAX (prefix_max, pts[i]);
+    }
+
+    *nb_keyframes = n;
+
+    memcpy (sorted_pts, pts, nb_packets * sizeof *pts);
+    qsort (sorted_pts, nb_packets, sizeof *sorted_pts, compare_int64);
+
+    for (i = 1; i < nb_packets; i++)
+    {
+        if (sorted_pts[i] == sorted_pts[i - 1])
+            return false;
+    }
+
+    return true;
+}
+
+// Splits the stream at independently decodable keyframes into ranges of about
+// the same number of packets and decodes them concurrently, each on its own
+// demuxer and decoder. Every frame goes to the place its pts gives it, so
+// decode order does not matter. A stream whose pts cannot order the frames is
+// decoded serially; one whose packets turn out not to decode to one frame
+// each is decoded again serially.
+static int decode_segments (AVFormatContext *format_ctx, DecodingContext *ctx,
+                            const char *filename, int nb_segments,
+                            int thread_count, int thread_type)
+{
+    AVCodecContext *codec = ctx->codec;
+    Segment *segments = NULL;
+    Keyframe *keyframes = NULL;
+    int64_t *pts = NULL, *sorted_pts = NULL;
+    int nb_keyframes, nb_packets, frame_size, segment_threads;
+    int i, k, n = 0, ret;
+    bool by_pts;
+
+    frame_size = avpicture_get_size (codec->pix_fmt, codec->width,
+                                     codec->height);
+    if (frame_size <= 0)
+        return AVERROR (EINVAL);
+
+    if ((ret = scan_keyframes (format_ctx, ctx->stream_index, &keyframes,
+                               &nb_keyframes, &pts, &nb_packets)) < 0)
+        goto end;
+
+    sorted_pts = av_malloc (FFMAX (nb_packets, 1) * sizeof *sorted_pts);
+    if (!sorted_pts)
+    {
+        ret = AVERROR (ENOMEM);
+        goto end;
+    }
+
+    by_pts = find_independent_keyframes (pts, nb_packets, keyframes,
+                                         &nb_keyframes, sorted_pts);
+    if (!by_pts)
+    {
+        av_log (NULL, AV_LOG_WARNING, "Timestamps do not order the frames, "
+                "decoding serially\n");
+        nb_keyframes = 0;
+    }
+
+    nb_segments = FFMIN (nb_segments, nb_keyframes + 1);
+
+    segments = av_mallocz (nb_segments * sizeof *segments);
+    if (!segments)
+    {
+        ret = AVERROR (ENOMEM);
+        goto end;
+    }
+
+    // the first segment starts at the beginning, each next one at the first
+    // keyframe past its share of the packets
+    segments[n].start_ts = AV_NOPTS_VALUE;
+    n++;
+    for (k = 0; k < nb_keyframes && n < nb_segments; k++)
+    {
+        if (keyframes[k].index >= (int64_t)nb_packets * n / nb_segments)
+        {
+            segments[n].start_ts = keyframes[k].ts;
+            segments[n].first_frame = keyframes[k].index;
+            n++;
+        }
+    }
+
+    // the thread count is shared between the segments unless given
+    segment_threads = thread_count ? thread_count
+                                   : FFMAX (1, av_cpu_count () / n);
+
+    // frames that are never decoded read back as zeroes
+    if (by_pts && ftruncate (ctx->fd, (int64_t)nb_packets * frame_size) < 0)
+    {
+        ret = AVERROR (errno);
+        goto end;
+    }
+
+    av_lockmgr_register (lock_manager);
+
+    for (i = 0; i < n; i++)
+    {
+        Segment *seg = &segments[i];
+
+        seg->filename = filename;
+        seg->fd = ctx->fd;
+        seg->frame_size = frame_size;
+        seg->thread_count = segment_threads;
+        seg->thread_type = thread_type;
+        seg->end_ts = i + 1 < n ? segments[i + 1].start_ts : AV_NOPTS_VALUE;
+        if (by_pts)
+        {
+            seg->frame_pts = sorted_pts;
+            seg->nb_frame_pts = nb_packets;
+            seg->end_frame = i + 1 < n ? segments[i + 1].first_frame
+                                       : nb_packets;
+        }
+        seg->thread = SDL_CreateThread (decode_segment, seg);
+        if (!seg->thread)
+            seg->ret = -1;
+    }
+
+    av_log (NULL, AV_LOG_INFO, "Decoding %d frames in %d segments\n",
+            nb_packets, n);
+
+    for (i = 0; i < n; i++)
+    {
+        if (segments[i].thread)
+            SDL_WaitThread (segments[i].thread, NULL);
+        if (segments[i].ret < 0)
+            ret = segments[i].ret;
+    }
+
+    av_lockmgr_register (NULL);
+
+    for (i = 0; ret >= 0 && by_pts && i < n; i++)
+    {
+        if (segments[i].mismatched)
+        {
+            Segment serial =
+            {
+                .filename = filename,
+                .fd = ctx->fd,
+                .frame_size = frame_size,
+                .thread_count = thread_count,
+                .thread_type = thread_type,
+                .start_ts = AV_NOPTS_VALUE,
+                .end_ts = AV_NOPTS_VALUE
+            };
+
+            av_log (NULL, AV_LOG_WARNING, "Packets do not decode to one frame "
+                    "each, decoding serially\n");
+
+            if (ftruncate (ctx->fd, 0) < 0)
+            {
+                ret = AVERROR (errno);
+                goto end;
+            }
+
+            decode_segment (&serial);
+            ret = serial.ret;
+            break;
+        }
+    }
+
+end:
+    av_free (segments);
+    av_free (keyframes);
+    av_free (pts);
+    av_free (sorted_pts);
+
+    return ret;
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc < 3)
+    DecodingContext ctx = { .fd = -1, .offset = -1 };
+    int async_depth = 0;
+    int nb_segments = 1;
+    bool direct = false;
+    int thread_count = 0, thread_type = 0;
+    int argi = 1;
+
+    for (; argi < argc && argv[argi][0] == '-'; argi++)
+    {
+        if (!strcmp (argv[argi], "-bench"))
+            ctx.bench = true;
+        else if (!strcmp (argv[argi], "-async") && argi + 1 < argc)
+            async_depth = atoi (argv[++argi]);
+        else if (!strcmp (argv[argi], "-direct"))
+            direct = true;
+        else if (!strcmp (argv[argi], "-threads") && argi + 1 < argc)
+            thread_count = atoi (argv[++argi]);
+        else if (!strcmp (argv[argi], "-thread-type") && argi + 1 < argc)
+            thread_type = decoder_parse_thread_type (argv[++argi]);
+        else if (!strcmp (argv[argi], "-segments") && argi + 1 < argc)
+            nb_segments = atoi (argv[++argi]);
+        else
+            break;
+    }
+
+    if (argc - argi < (ctx.bench ? 1 : 2) || thread_type < 0
+        || (nb_segments > 1 && (ctx.bench || async_depth > 0 || direct)))
     {
-        printf ("Usage: %s <src_filename> <dst_filename>\n", argv[0]);
+        printf ("Usage: %s [-bench] [-async <depth>] [-direct] [-threads <n>]"
+                " [-thread-type frame|slice|auto] [-segments <n>]"
+                " <src_filename> <dst_filename>\n"
+                "  -bench        decode to a null sink and report throughput,"
+                " no dst_filename\n"
+                "  -async        write from a separate thread through <depth>"
+                " buffers of %d MB\n"
+                "  -direct       bypass the page cache with O_DIRECT,"
+                " implies -async 2\n"
+                "  -threads      decoding threads, 0 (default) for one per"
+                " core\n"
+                "  -thread-type  frame or slice threading, auto (default)"
+                " lets the decoder choose\n"
+                "  -segments     decode <n> keyframe ranges concurrently,"
+                " not with -bench or -async\n",
+                argv[0], ASYNC_BUFFER_SIZE / (1024 * 1024));
         return -1;
     }
 
-    const char *src_filename = argv[1];
-    const char *dst_filename = argv[2];
+    // O_DIRECT needs the aligned buffers of the async writer
+    if (direct && async_depth < 2)
+        async_depth = 2;
+
+    const char *src_filename = argv[argi];
+    const char *dst_filename = ctx.bench ? NULL : argv[argi + 1];
 
     av_register_all();
 
@@ -72,8 +812,6 @@ int main(int argc, char *argv[])
 
     av_dump_format (format_ctx, 0, src_filename, 0);
 
-    DecodingContext ctx = {0};
-
     AVCodec *decoder = NULL;
     ctx.stream_index = av_find_best_stream (format_ctx, AVMEDIA_TYPE_VIDEO,
                                             -1, -1, &decoder, 0);
@@ -84,7 +822,7 @@ int main(int argc, char *argv[])
     }
 
     ctx.codec = format_ctx->streams[ctx.stream_index]->codec;
-    if (avcodec_open2 (ctx.codec, decoder, NULL) < 0)
+    if (decoder_open (ctx.codec, decoder, thread_count, thread_type) < 0)
     {
         av_log (NULL, AV_LOG_ERROR, "Could not open codec\n");
         goto end;
@@ -97,20 +835,24 @@ int main(int argc, char *argv[])
         goto end;
     }
 
-    ctx.bufsize = av_image_alloc (ctx.data, ctx.linesize,
-                                  ctx.codec->width, ctx.codec->height,
-                                  ctx.codec->pix_fmt, 1);
-    if (ctx.bufsize < 0)
+    if (!ctx.bench && async_depth > 0)
     {
-        av_log (NULL, AV_LOG_ERROR, "Could not allocate video buffer\n");
-        goto end;
+        if (async_writer_open (&ctx.writer, dst_filename, async_depth,
+                               ASYNC_BUFFER_SIZE, direct) < 0)
+        {
+            av_log (NULL, AV_LOG_ERROR, "Could not open output file\n");
+            goto end;
+        }
+        ctx.async = true;
     }
-
-    ctx.file = fopen (dst_filename, "wb");
-    if (!ctx.file)
+    else if (!ctx.bench)
     {
-        av_log (NULL, AV_LOG_ERROR, "Could not open output file\n");
-        goto end;
+        ctx.fd = open (dst_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (ctx.fd < 0)
+        {
+            av_log (NULL, AV_LOG_ERROR, "Could not open output file\n");
+            goto end;
+        }
     }
 
     AVPacket pkt =
@@ -119,21 +861,51 @@ int main(int argc, char *argv[])
         .size = 0
     };
 
-    while (av_read_frame (format_ctx, &pkt) >= 0)
+    int64_t start_time = av_gettime ();
+
+    if (nb_segments > 1)
     {
-        process_packet (&pkt, &ctx);
+        if (decode_segments (format_ctx, &ctx, src_filename, nb_segments,
+                             thread_count, thread_type) < 0)
+        {
+            av_log (NULL, AV_LOG_ERROR, "Could not decode segments\n");
+            goto end;
+        }
+    }
+    else
+    {
+        while (av_read_frame (format_ctx, &pkt) >= 0)
+        {
+            process_packet (&pkt, &ctx);
 
-        av_free_packet (&pkt);
+            av_free_packet (&pkt);
+        }
+
+        // flush cached frames
+        pkt.data = NULL;
+        pkt.size = 0;
+        do
+        {
+            process_packet(&pkt, &ctx);
+        }
+        while (ctx.got_frame);
     }
 
-    // flush cached frames
-    pkt.data = NULL;
-    pkt.size = 0;
-    do
+    if (ctx.bench)
     {
-        process_packet(&pkt, &ctx);
+        print_bench_report (&ctx, av_gettime () - start_time);
+        goto end;
+    }
+
+    if (ctx.async)
+    {
+        ctx.async = false;
+        if (async_writer_close (&ctx.writer) < 0)
+        {
+            av_log (NULL, AV_LOG_ERROR, "Error writing output file\n");
+            goto end;
+        }
     }
-    while (ctx.got_frame);
 
     av_log (NULL, AV_LOG_INFO, "ffplay -f rawvideo -pix_fmt %s -video_size %dx%d %s\n",
             av_get_pix_fmt_name (ctx.codec->pix_fmt),
@@ -142,9 +914,11 @@ int main(int argc, char *argv[])
 end:
     av_free_packet (&pkt);
     av_free (ctx.frame);
-    av_free (ctx.data[0]);
-    if (ctx.file)
-        fclose (ctx.file);
+    av_free (ctx.latencies);
+    if (ctx.async)
+        async_writer_close (&ctx.writer);
+    if (ctx.fd >= 0)
+        close (ctx.fd);
     if (ctx.codec)
         avcodec_close (ctx.codec);
     if (format_ctx)
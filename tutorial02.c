@@ -1,3 +1,6 @@
+#include "decoder.h"
+#include "overlay_pool.h"
+#include "overlay_upload.h"
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavutil/imgutils.h>
@@ -19,6 +22,7 @@ typedef struct
 
     SDL_Rect rect;
     SDL_Overlay *overlay;
+    OverlayPool pool;
 } DecodingContext;
 
 static int process_packet(AVPacket *pkt, DecodingContext *ctx)
@@ -36,23 +40,32 @@ static int process_packet(AVPacket *pkt, DecodingContext *ctx)
 
         if (ctx->got_frame)
         {
-            SDL_LockYUVOverlay (ctx->overlay);
-
-            AVPicture pict;
-            pict.data[0] = ctx->overlay->pixels[0];
-            pict.data[1] = ctx->overlay->pixels[2];
-            pict.data[2] = ctx->overlay->pixels[1];
-
-            pict.linesize[0] = ctx->overlay->pitches[0];
-            pict.linesize[1] = ctx->overlay->pitches[2];
-            pict.linesize[2] = ctx->overlay->pitches[1];
-
-            av_image_copy(pict.data, pict.linesize,
-                          (const uint8_t **)frame->data, frame->linesize,
-                          codec->pix_fmt, codec->width, codec->height);
-
-            SDL_UnlockYUVOverlay (ctx->overlay);
-            SDL_DisplayYUVOverlay (ctx->overlay, &ctx->rect);
+            // decoded in place unless the pool could not provide an overlay
+            if (!overlay_pool_display (&ctx->pool, frame, ctx->rect.x,
+                                       ctx->rect.y))
+            {
+                SDL_LockYUVOverlay (ctx->overlay);
+
+                if (overlay_upload (ctx->overlay, frame, codec->pix_fmt,
+                                    codec->width, codec->height) < 0)
+                {
+                    AVPicture pict;
+                    pict.data[0] = ctx->overlay->pixels[0];
+                    pict.data[1] = ctx->overlay->pixels[2];
+                    pict.data[2] = ctx->overlay->pixels[1];
+
+                    pict.linesize[0] = ctx->overlay->pitches[0];
+                    pict.linesize[1] = ctx->overlay->pitches[2];
+                    pict.linesize[2] = ctx->overlay->pitches[1];
+
+                    av_image_copy(pict.data, pict.linesize,
+                                  (const uint8_t **)frame->data, frame->linesize,
+                                  codec->pix_fmt, codec->width, codec->height);
+                }
+
+                SDL_UnlockYUVOverlay (ctx->overlay);
+                SDL_DisplayYUVOverlay (ctx->overlay, &ctx->rect);
+            }
         }
     }
 
@@ -105,7 +118,14 @@ int main(int argc, char *argv[])
     }
 
     ctx.codec = format_ctx->streams[ctx.stream_index]->codec;
-    if (avcodec_open2 (ctx.codec, decoder, NULL) < 0)
+    if (overlay_pool_init (&ctx.pool) < 0)
+    {
+        av_log (NULL, AV_LOG_ERROR, "Could not create overlay pool\n");
+        goto end;
+    }
+    overlay_pool_attach (&ctx.pool, ctx.codec);
+
+    if (decoder_open (ctx.codec, decoder, 0, 0) < 0)
     {
         av_log (NULL, AV_LOG_ERROR, "Could not open codec\n");
         goto end;
@@ -127,6 +147,8 @@ int main(int argc, char *argv[])
         goto end;
     }
 
+    ctx.pool.screen = screen;
+
     ctx.overlay = SDL_CreateYUVOverlay (
                 ctx.codec->width, ctx.codec->height, SDL_YV12_OVERLAY, screen);
 
@@ -177,6 +199,7 @@ end:
     av_free (ctx.data[0]);
     if (ctx.codec)
         avcodec_close (ctx.codec);
+    overlay_pool_destroy (&ctx.pool);
     if (format_ctx)
         avformat_close_input (&format_ctx);
     SDL_Quit ();
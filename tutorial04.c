@@ -1,7 +1,12 @@
+#include "decoder.h"
+#include "overlay_pool.h"
+#include "overlay_upload.h"
 #include "packet_queue.h"
+#include "stream_router.h"
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/time.h>
 #include <SDL.h>
 #include <SDL_thread.h>
 #include <stddef.h>
@@ -12,6 +17,9 @@
 #include <signal.h>
 
 #define SDL_AUDIO_BUFFER_SIZE 1024
+#define AUDIOQ_RING_SIZE 256
+// packets the audio decoder takes off the queue at a time
+#define AUDIO_BATCH_SIZE 16
 
 int quit = 0;
 
@@ -31,6 +39,7 @@ typedef struct PlayerContext
     int audio_stream_index;
 
     PacketQueue audioq;
+    int64_t audio_timeout;
 
     AVFrame *frame;
     int got_frame;
@@ -43,6 +52,9 @@ typedef struct PlayerContext
 
     SDL_Rect rect;
     SDL_Overlay *overlay;
+    OverlayPool pool;
+
+    StreamRouter router;
 } PlayerContext;
 
 static int process_packet(AVPacket *pkt, PlayerContext *ctx)
@@ -60,34 +72,73 @@ static int process_packet(AVPacket *pkt, PlayerContext *ctx)
 
         if (ctx->got_frame)
         {
-            SDL_LockYUVOverlay (ctx->overlay);
-
-            AVPicture pict;
-            pict.data[0] = ctx->overlay->pixels[0];
-            pict.data[1] = ctx->overlay->pixels[2];
-            pict.data[2] = ctx->overlay->pixels[1];
-
-            pict.linesize[0] = ctx->overlay->pitches[0];
-            pict.linesize[1] = ctx->overlay->pitches[2];
-            pict.linesize[2] = ctx->overlay->pitches[1];
-
-            av_image_copy(pict.data, pict.linesize,
-                          (const uint8_t **)frame->data, frame->linesize,
-                          codec->pix_fmt, codec->width, codec->height);
-
-            SDL_UnlockYUVOverlay (ctx->overlay);
-            SDL_DisplayYUVOverlay (ctx->overlay, &ctx->rect);
+            // decoded in place unless the pool could not provide an overlay
+            if (!overlay_pool_display (&ctx->pool, frame, ctx->rect.x,
+                                       ctx->rect.y))
+            {
+                SDL_LockYUVOverlay (ctx->overlay);
+
+                if (overlay_upload (ctx->overlay, frame, codec->pix_fmt,
+                                    codec->width, codec->height) < 0)
+                {
+                    AVPicture pict;
+                    pict.data[0] = ctx->overlay->pixels[0];
+                    pict.data[1] = ctx->overlay->pixels[2];
+                    pict.data[2] = ctx->overlay->pixels[1];
+
+                    pict.linesize[0] = ctx->overlay->pitches[0];
+                    pict.linesize[1] = ctx->overlay->pitches[2];
+                    pict.linesize[2] = ctx->overlay->pitches[1];
+
+                    av_image_copy(pict.data, pict.linesize,
+                                  (const uint8_t **)frame->data, frame->linesize,
+                                  codec->pix_fmt, codec->width, codec->height);
+                }
+
+                SDL_UnlockYUVOverlay (ctx->overlay);
+                SDL_DisplayYUVOverlay (ctx->overlay, &ctx->rect);
+            }
 
             av_free_packet (pkt);
         }
     }
-    else if (pkt->stream_index == ctx->audio_stream_index)
+    else if (stream_router_dispatch (&ctx->router, pkt) <= 0)
     {
-        packet_queue_put (&ctx->audioq, pkt);
+        av_free_packet (pkt);
     }
-    else
+
+    return 0;
+}
+
+// Runs on a router thread of its own; only logs the text, there is nothing
+// to draw it on.
+static int subtitle_worker (PacketQueue *q, void *opaque)
+{
+    AVCodecContext *codec = opaque;
+    AVSubtitle subtitle;
+    AVPacket pkt;
+    int got_subtitle;
+    unsigned i;
+
+    while (packet_queue_get (q, &pkt, true) > 0)
     {
-        av_free_packet (pkt);
+        if (avcodec_decode_subtitle2 (codec, &subtitle, &got_subtitle,
+                                      &pkt) >= 0 && got_subtitle)
+        {
+            for (i = 0; i < subtitle.num_rects; i++)
+            {
+                AVSubtitleRect *rect = subtitle.rects[i];
+
+                if (rect->type == SUBTITLE_ASS && rect->ass)
+                    av_log (NULL, AV_LOG_INFO, "Subtitle: %s", rect->ass);
+                else if (rect->type == SUBTITLE_TEXT && rect->text)
+                    av_log (NULL, AV_LOG_INFO, "Subtitle: %s\n", rect->text);
+            }
+
+            avsubtitle_free (&subtitle);
+        }
+
+        av_free_packet (&pkt);
     }
 
     return 0;
@@ -96,8 +147,10 @@ static int process_packet(AVPacket *pkt, PlayerContext *ctx)
 int decode_audio_frame (PlayerContext *ctx, uint8_t **buf)
 {
     static AVPacket pkt, cur_pkt;
+    static AVPacket pending[AUDIO_BATCH_SIZE];
+    static int nb_pending, next_pending;
     static AVFrame *frame;
-    int got_frame, decoded_bytes;
+    int got_frame, decoded_bytes, ret;
 
     if (!frame)
     {
@@ -141,10 +194,27 @@ int decode_audio_frame (PlayerContext *ctx, uint8_t **buf)
         if (quit)
             return -1;
 
-        // read next packet
-        if (packet_queue_get (&ctx->audioq, &cur_pkt, 1) < 0)
-            return -1;
+        // take whatever is already queued, and only wait for a single packet,
+        // giving up in time to meet the device deadline
+        if (next_pending == nb_pending)
+        {
+            nb_pending = 0;
+            next_pending = 0;
+
+            ret = packet_queue_get_batch (&ctx->audioq, pending,
+                                          AUDIO_BATCH_SIZE, 0, false);
+            if (ret == 0)
+                ret = packet_queue_get_timeout (&ctx->audioq, pending,
+                                                ctx->audio_timeout);
+            if (ret < 0)
+                return -1;
+            if (ret == 0)
+                return AVERROR (EAGAIN);
+
+            nb_pending = ret;
+        }
 
+        cur_pkt = pending[next_pending++];
         pkt = cur_pkt;
     }
 }
@@ -159,12 +229,22 @@ void audio_callback (void *userdata, Uint8 *stream, int len)
     PlayerContext *ctx = userdata;
     int send_len, decoded_size;
 
+    // the demuxer may be sleeping on a full queue
+    if (quit)
+        packet_queue_stop (&ctx->audioq);
+
     while (len > 0 && !quit)
     {
         if (buf_index >= buf_size)
         {
             decoded_size = decode_audio_frame (ctx, &buf);
-            if (decoded_size < 0)
+            if (decoded_size == AVERROR (EAGAIN))
+            {
+                // queue ran dry, play silence and try again next time
+                memset (stream, 0, len);
+                return;
+            }
+            else if (decoded_size < 0)
             {
                 av_log (NULL, AV_LOG_WARNING, "Could not decode audio frame");
                 buf = silence_buf;
@@ -194,16 +274,31 @@ void audio_callback (void *userdata, Uint8 *stream, int len)
 
 int main(int argc, char *argv[])
 {
-    if (argc < 2)
+    // seconds between audio queue statistics dumps, 0 disables them
+    int stats_interval = 0;
+    int argi = 1;
+    unsigned i;
+
+    for (; argi < argc && argv[argi][0] == '-'; argi++)
     {
-        printf ("Usage: %s <filename>\n", argv[0]);
+        if (!strcmp (argv[argi], "-stats") && argi + 1 < argc)
+            stats_interval = atoi (argv[++argi]);
+        else
+            break;
+    }
+
+    if (argc - argi < 1)
+    {
+        printf ("Usage: %s [-stats <seconds>] <filename>\n"
+                "  -stats  dump the audio queue statistics every <seconds>\n",
+                argv[0]);
         return -1;
     }
 
     signal (SIGINT, signal_handler);
     signal (SIGTERM, signal_handler);
 
-    const char *src_filename = argv[1];
+    const char *src_filename = argv[argi];
 
     if (SDL_Init (SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER))
     {
@@ -221,6 +316,14 @@ int main(int argc, char *argv[])
         return -1;
     }
 
+    // zeroed before the first goto, the teardown at end copes with that
+    PlayerContext ctx = {0};
+    AVPacket pkt =
+    {
+        .data = NULL,
+        .size = 0
+    };
+
     if (avformat_find_stream_info (format_ctx, NULL) < 0)
     {
         av_log (NULL, AV_LOG_ERROR, "Could not find stream information\n");
@@ -229,8 +332,6 @@ int main(int argc, char *argv[])
 
     av_dump_format (format_ctx, 0, src_filename, 0);
 
-    PlayerContext ctx = {0};
-
     AVCodec *video_decoder = NULL;
     ctx.video_stream_index = av_find_best_stream (format_ctx,
                                 AVMEDIA_TYPE_VIDEO, -1, -1, &video_decoder, 0);
@@ -244,7 +345,14 @@ int main(int argc, char *argv[])
             ctx.video_stream_index);
 
     ctx.video_codec = format_ctx->streams[ctx.video_stream_index]->codec;
-    if (avcodec_open2 (ctx.video_codec, video_decoder, NULL) < 0)
+    if (overlay_pool_init (&ctx.pool) < 0)
+    {
+        av_log (NULL, AV_LOG_ERROR, "Could not create overlay pool\n");
+        goto end;
+    }
+    overlay_pool_attach (&ctx.pool, ctx.video_codec);
+
+    if (decoder_open (ctx.video_codec, video_decoder, 0, 0) < 0)
     {
         av_log (NULL, AV_LOG_ERROR, "Could not open video codec\n");
         goto end;
@@ -263,7 +371,7 @@ int main(int argc, char *argv[])
             ctx.audio_stream_index);
 
     ctx.audio_codec = format_ctx->streams[ctx.audio_stream_index]->codec;
-    if (avcodec_open2 (ctx.audio_codec, audio_decoder, NULL) < 0)
+    if (decoder_open (ctx.audio_codec, audio_decoder, 0, 0) < 0)
     {
         av_log (NULL, AV_LOG_ERROR, "Could not open audio codec\n");
         goto end;
@@ -285,6 +393,8 @@ int main(int argc, char *argv[])
         goto end;
     }
 
+    ctx.pool.screen = screen;
+
     ctx.overlay = SDL_CreateYUVOverlay (
                 ctx.video_codec->width, ctx.video_codec->height, SDL_YV12_OVERLAY, screen);
 
@@ -316,21 +426,61 @@ int main(int argc, char *argv[])
         goto end;
     }
 
-    packet_queue_init (&ctx.audioq);
-    SDL_PauseAudio (0);
+    // half of the device buffer period
+    ctx.audio_timeout = audio_spec.samples * 1000000LL / audio_spec.freq / 2;
 
-    AVPacket pkt =
+    if (packet_queue_init_ring (&ctx.audioq, AUDIOQ_RING_SIZE) < 0)
     {
-        .data = NULL,
-        .size = 0
-    };
+        av_log (NULL, AV_LOG_ERROR, "Could not allocate audio queue\n");
+        goto end;
+    }
+
+    if (stream_router_init (&ctx.router, format_ctx->nb_streams) < 0 ||
+            stream_router_set_queue (&ctx.router, ctx.audio_stream_index,
+                                     &ctx.audioq) < 0)
+    {
+        av_log (NULL, AV_LOG_ERROR, "Could not set up stream routing\n");
+        goto end;
+    }
+
+    for (i = 0; i < format_ctx->nb_streams; i++)
+    {
+        AVCodecContext *codec = format_ctx->streams[i]->codec;
+        AVCodec *decoder;
+
+        if (codec->codec_type != AVMEDIA_TYPE_SUBTITLE)
+            continue;
+
+        decoder = avcodec_find_decoder (codec->codec_id);
+        if (!decoder || decoder_open (codec, decoder, 1, 0) < 0)
+        {
+            av_log (NULL, AV_LOG_WARNING,
+                    "Could not open subtitle stream %u\n", i);
+            continue;
+        }
+
+        if (stream_router_add_worker (&ctx.router, i, subtitle_worker,
+                                      codec) < 0)
+            av_log (NULL, AV_LOG_WARNING,
+                    "Could not start decoding subtitle stream %u\n", i);
+    }
+
+    SDL_PauseAudio (0);
 
     SDL_Event event;
+    int64_t stats_time = av_gettime ();
 
     while ((av_read_frame (format_ctx, &pkt) >= 0) && !quit)
     {
         process_packet (&pkt, &ctx);
 
+        if (stats_interval > 0 &&
+                av_gettime () - stats_time >= stats_interval * 1000000LL)
+        {
+            packet_queue_dump_stats (&ctx.audioq, "audioq");
+            stats_time = av_gettime ();
+        }
+
         SDL_PollEvent (&event);
         switch (event.type) {
         case SDL_QUIT:
@@ -342,6 +492,8 @@ int main(int argc, char *argv[])
         }
     }
 
+    stream_router_publish (&ctx.router);
+
     // flush cached frames
     pkt.data = NULL;
     pkt.size = 0;
@@ -357,9 +509,23 @@ end:
     av_free (ctx.data[0]);
     if (ctx.video_codec)
         avcodec_close (ctx.video_codec);
+    overlay_pool_destroy (&ctx.pool);
+    // the audio callback and the workers may be waiting for packets
+    stream_router_stop (&ctx.router);
+    SDL_CloseAudio ();
+    // joins the workers before their codecs go away
+    stream_router_destroy (&ctx.router);
     if (format_ctx)
+    {
+        for (i = 0; i < format_ctx->nb_streams; i++)
+        {
+            if (format_ctx->streams[i]->codec->codec_type
+                    == AVMEDIA_TYPE_SUBTITLE)
+                avcodec_close (format_ctx->streams[i]->codec);
+        }
         avformat_close_input (&format_ctx);
-    SDL_CloseAudio ();
+    }
+    packet_queue_destroy (&ctx.audioq);
     SDL_Quit ();
 
     return 0;
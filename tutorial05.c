@@ -6,7 +6,7 @@
 // Tested on Gentoo, CVS version 5/01/07 compiled with GCC 4.1.1
 // Use
 //
-// gcc -o tutorial05 tutorial05.c -lavformat -lavcodec -lz -lm `sdl-config --cflags --libs`
+// gcc -o tutorial05 tutorial05.c decoder.c packet_queue.c stream_router.c -lavformat -lavcodec -lavutil -lz -lm -lrt `sdl-config --cflags --libs`
 // to build (assuming libavformat and libavcodec are correctly installed, 
 // and assuming you have sdl-config. Please refer to SDL docs for your installation.)
 //
@@ -15,6 +15,9 @@
 //
 // to play the video.
 
+#include "decoder.h"
+#include "packet_queue.h"
+#include "stream_router.h"
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 
@@ -26,30 +29,28 @@
 #endif
 
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
+#include <errno.h>
+#include <time.h>
 
 #define SDL_AUDIO_BUFFER_SIZE 1024
 
 #define MAX_AUDIOQ_SIZE (5 * 16 * 1024)
 #define MAX_VIDEOQ_SIZE (5 * 256 * 1024)
+#define MAX_QUEUE_DURATION 10.0
 
 #define AV_SYNC_THRESHOLD 0.01
 #define AV_NOSYNC_THRESHOLD 10.0
+#define LATE_STREAK_SKIP_NONREF 8 /* late pictures in a row before the decoder sheds work */
 
 #define FF_ALLOC_EVENT   (SDL_USEREVENT)
 #define FF_REFRESH_EVENT (SDL_USEREVENT + 1)
 #define FF_QUIT_EVENT (SDL_USEREVENT + 2)
+#define EVENT_POLL_INTERVAL 0.01 /* longest the main thread sleeps without checking events */
 
-#define VIDEO_PICTURE_QUEUE_SIZE 1
-
-typedef struct PacketQueue {
-  AVPacketList *first_pkt, *last_pkt;
-  int nb_packets;
-  int size;
-  SDL_mutex *mutex;
-  SDL_cond *cond;
-} PacketQueue;
-
+#define VIDEO_PICTURE_QUEUE_SIZE 3 /* default depth, -pictq overrides it */
+#define MAX_PICTURE_QUEUE_SIZE 64
 
 typedef struct VideoPicture {
   SDL_Overlay *bmp;
@@ -79,14 +80,22 @@ typedef struct VideoState {
   double          video_clock; ///<pts of last decoded frame / predicted pts of next decoded frame
   AVStream        *video_st;
   PacketQueue     videoq;
+  StreamRouter    router; /* stream index to packet queue */
 
-  VideoPicture    pictq[VIDEO_PICTURE_QUEUE_SIZE];
+  VideoPicture    *pictq; /* ring of pictq_capacity pictures */
+  int             pictq_capacity;
   int             pictq_size, pictq_rindex, pictq_windex;
+  int             frames_dropped, frames_late;
+  int             late_streak;
+  int             skip_nonref; /* stored by the refresh timer, loaded by the video thread, atomically */
+  int             skip_nonref_periods;
   SDL_mutex       *pictq_mutex;
   SDL_cond        *pictq_cond;
+  int             pictq_waiting; /* main thread waits for an FF_REFRESH_EVENT */
   
   SDL_Thread      *parse_tid;
   SDL_Thread      *video_tid;
+  int64_t         refresh_time; /* next picture deadline, CLOCK_MONOTONIC ns */
 
   char            filename[1024];
   int             quit;
@@ -98,72 +107,6 @@ SDL_Surface     *screen;
    can be global in case we need it. */
 VideoState *global_video_state;
 
-void packet_queue_init(PacketQueue *q) {
-  memset(q, 0, sizeof(PacketQueue));
-  q->mutex = SDL_CreateMutex();
-  q->cond = SDL_CreateCond();
-}
-int packet_queue_put(PacketQueue *q, AVPacket *pkt) {
-
-  AVPacketList *pkt1;
-  if(av_dup_packet(pkt) < 0) {
-    return -1;
-  }
-  pkt1 = av_malloc(sizeof(AVPacketList));
-  if (!pkt1)
-    return -1;
-  pkt1->pkt = *pkt;
-  pkt1->next = NULL;
-  
-  SDL_LockMutex(q->mutex);
-
-  if (!q->last_pkt)
-    q->first_pkt = pkt1;
-  else
-    q->last_pkt->next = pkt1;
-  q->last_pkt = pkt1;
-  q->nb_packets++;
-  q->size += pkt1->pkt.size;
-  SDL_CondSignal(q->cond);
-  
-  SDL_UnlockMutex(q->mutex);
-  return 0;
-}
-static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block)
-{
-  AVPacketList *pkt1;
-  int ret;
-
-  SDL_LockMutex(q->mutex);
-  
-  for(;;) {
-    
-    if(global_video_state->quit) {
-      ret = -1;
-      break;
-    }
-
-    pkt1 = q->first_pkt;
-    if (pkt1) {
-      q->first_pkt = pkt1->next;
-      if (!q->first_pkt)
-	q->last_pkt = NULL;
-      q->nb_packets--;
-      q->size -= pkt1->pkt.size;
-      *pkt = pkt1->pkt;
-      av_free(pkt1);
-      ret = 1;
-      break;
-    } else if (!block) {
-      ret = 0;
-      break;
-    } else {
-      SDL_CondWait(q->cond, q->mutex);
-    }
-  }
-  SDL_UnlockMutex(q->mutex);
-  return ret;
-}
 double get_audio_clock(VideoState *is) {
   double pts;
   int hw_buf_size, bytes_per_sec, n;
@@ -262,17 +205,15 @@ void audio_callback(void *userdata, Uint8 *stream, int len) {
   }
 }
 
-static Uint32 sdl_refresh_timer_cb(Uint32 interval, void *opaque) {
-  SDL_Event event;
-  event.type = FF_REFRESH_EVENT;
-  event.user.data1 = opaque;
-  SDL_PushEvent(&event);
-  return 0; /* 0 means stop timer */
+static int64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-/* schedule a video refresh in 'delay' ms */
-static void schedule_refresh(VideoState *is, int delay) {
-  SDL_AddTimer(delay, sdl_refresh_timer_cb, is);
+/* schedule a video refresh in 'delay' seconds */
+static void schedule_refresh(VideoState *is, double delay) {
+  is->refresh_time = monotonic_ns() + (int64_t)(delay * 1e9);
 }
 
 void video_display(VideoState *is) {
@@ -318,10 +259,19 @@ void video_refresh_timer(void *userdata) {
   VideoState *is = (VideoState *)userdata;
   VideoPicture *vp;
   double actual_delay, delay, sync_threshold, ref_clock, diff;
+  int pictq_size;
   
   if(is->video_st) {
-    if(is->pictq_size == 0) {
-      schedule_refresh(is, 1);
+    /* under the lock, so the decoder's setup of frame_timer is visible */
+    SDL_LockMutex(is->pictq_mutex);
+    pictq_size = is->pictq_size;
+    SDL_UnlockMutex(is->pictq_mutex);
+    if(pictq_size == 0) {
+      /* nothing to show, sleep until queue_picture sends an event */
+      SDL_LockMutex(is->pictq_mutex);
+      is->pictq_waiting = is->pictq_size == 0;
+      SDL_UnlockMutex(is->pictq_mutex);
+      schedule_refresh(is, 0);
     } else {
       vp = &is->pictq[is->pictq_rindex];
 
@@ -351,16 +301,38 @@ void video_refresh_timer(void *userdata) {
       is->frame_timer += delay;
       /* computer the REAL delay */
       actual_delay = is->frame_timer - (av_gettime() / 1000000.0);
-      if(actual_delay < 0.010) {
-	/* Really it should skip the picture instead */
-	actual_delay = 0.010;
+
+      if(actual_delay < 0) {
+	is->late_streak++;
+      } else {
+	is->late_streak = 0;
+      }
+      /* persistently behind: let the decoder drop what nothing refers to */
+      if(!is->skip_nonref && is->late_streak >= LATE_STREAK_SKIP_NONREF) {
+	is->skip_nonref_periods++;
+      }
+      __atomic_store_n(&is->skip_nonref, is->late_streak >= LATE_STREAK_SKIP_NONREF,
+		       __ATOMIC_RELAXED);
+
+      if(actual_delay <= -delay && pictq_size > 1) {
+	/* the next picture is due already, skip this one */
+	is->frames_dropped++;
+	schedule_refresh(is, 0.001);
+      } else {
+	if(actual_delay < 0) {
+	  is->frames_late++;
+	}
+	if(actual_delay < 0.010) {
+	  actual_delay = 0.010;
+	}
+	schedule_refresh(is, actual_delay);
+
+	/* show the picture! */
+	video_display(is);
       }
-      schedule_refresh(is, (int)(actual_delay * 1000 + 0.5));
-      /* show the picture! */
-      video_display(is);
       
       /* update queue for next picture! */
-      if(++is->pictq_rindex == VIDEO_PICTURE_QUEUE_SIZE) {
+      if(++is->pictq_rindex == is->pictq_capacity) {
 	is->pictq_rindex = 0;
       }
       SDL_LockMutex(is->pictq_mutex);
@@ -369,30 +341,71 @@ void video_refresh_timer(void *userdata) {
       SDL_UnlockMutex(is->pictq_mutex);
     }
   } else {
-    schedule_refresh(is, 100);
+    schedule_refresh(is, 0.1);
+  }
+}
+
+/* True while the picture queue is empty and the main thread may block
+   in SDL_WaitEvent, queue_picture wakes it with an FF_REFRESH_EVENT. */
+static int refresh_idle(VideoState *is) {
+  int idle;
+
+  SDL_LockMutex(is->pictq_mutex);
+  idle = is->pictq_waiting;
+  SDL_UnlockMutex(is->pictq_mutex);
+  return idle;
+}
+
+/* Sleeps until the next picture is due, but wakes at least every
+   EVENT_POLL_INTERVAL so the main thread keeps pumping events. */
+static void wait_refresh(VideoState *is) {
+  struct timespec ts;
+  int64_t wake = monotonic_ns() + (int64_t)(EVENT_POLL_INTERVAL * 1e9);
+
+  if(wake > is->refresh_time) {
+    wake = is->refresh_time;
   }
+  ts.tv_sec = wake / 1000000000;
+  ts.tv_nsec = wake % 1000000000;
+  while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
 }
       
 void alloc_picture(void *userdata) {
 
   VideoState *is = (VideoState *)userdata;
   VideoPicture *vp;
+  int i, nb_free;
 
-  vp = &is->pictq[is->pictq_windex];
-  if(vp->bmp) {
-    // we already have one make another, bigger/smaller
-    SDL_FreeYUVOverlay(vp->bmp);
-  }
-  // Allocate a place to put our YUV image on that screen
-  vp->bmp = SDL_CreateYUVOverlay(is->video_st->codec->width,
-				 is->video_st->codec->height,
-				 SDL_YV12_OVERLAY,
-				 screen);
-  vp->width = is->video_st->codec->width;
-  vp->height = is->video_st->codec->height;
-  
+  /* (re)allocate every slot that holds no queued picture, so the
+     whole ring is ready before the first frame is decoded; the lock is
+     held throughout, queue_picture checks the slots under it too */
   SDL_LockMutex(is->pictq_mutex);
-  vp->allocated = 1;
+  nb_free = is->pictq_capacity - is->pictq_size;
+
+  for(i = 0; i < nb_free; i++) {
+    vp = &is->pictq[(is->pictq_windex + i) % is->pictq_capacity];
+    if(vp->bmp &&
+       vp->width == is->video_st->codec->width &&
+       vp->height == is->video_st->codec->height) {
+      continue;
+    }
+    if(vp->bmp) {
+      // we already have one make another, bigger/smaller
+      SDL_FreeYUVOverlay(vp->bmp);
+    }
+    // Allocate a place to put our YUV image on that screen
+    vp->bmp = SDL_CreateYUVOverlay(is->video_st->codec->width,
+				   is->video_st->codec->height,
+				   SDL_YV12_OVERLAY,
+				   screen);
+    vp->width = is->video_st->codec->width;
+    vp->height = is->video_st->codec->height;
+  }
+
+  for(i = 0; i < nb_free; i++) {
+    is->pictq[(is->pictq_windex + i) % is->pictq_capacity].allocated = 1;
+  }
   SDL_CondSignal(is->pictq_cond);
   SDL_UnlockMutex(is->pictq_mutex);
 
@@ -406,19 +419,21 @@ int queue_picture(VideoState *is, AVFrame *pFrame, double pts) {
 
   /* wait until we have space for a new pic */
   SDL_LockMutex(is->pictq_mutex);
-  while(is->pictq_size >= VIDEO_PICTURE_QUEUE_SIZE &&
+  while(is->pictq_size >= is->pictq_capacity &&
 	!is->quit) {
     SDL_CondWait(is->pictq_cond, is->pictq_mutex);
   }
-  SDL_UnlockMutex(is->pictq_mutex);
 
-  if(is->quit)
+  if(is->quit) {
+    SDL_UnlockMutex(is->pictq_mutex);
     return -1;
+  }
 
   // windex is set to 0 initially
   vp = &is->pictq[is->pictq_windex];
 
-  /* allocate or resize the buffer! */
+  /* allocate or resize the buffer! still under the lock, the main
+     thread may be replacing the overlay right now */
   if(!vp->bmp ||
      vp->width != is->video_st->codec->width ||
      vp->height != is->video_st->codec->height) {
@@ -431,15 +446,17 @@ int queue_picture(VideoState *is, AVFrame *pFrame, double pts) {
     SDL_PushEvent(&event);
 
     /* wait until we have a picture allocated */
-    SDL_LockMutex(is->pictq_mutex);
     while(!vp->allocated && !is->quit) {
       SDL_CondWait(is->pictq_cond, is->pictq_mutex);
     }
-    SDL_UnlockMutex(is->pictq_mutex);
     if(is->quit) {
+      SDL_UnlockMutex(is->pictq_mutex);
       return -1;
     }
   }
+  /* the main thread only replaces overlays that do not match the codec
+     size, which this one does until the next frame is decoded */
+  SDL_UnlockMutex(is->pictq_mutex);
   /* We have a place to put our picture on the queue */
   /* If we are skipping a frame, do we set this to null 
      but still return vp->allocated = 1? */
@@ -461,19 +478,33 @@ int queue_picture(VideoState *is, AVFrame *pFrame, double pts) {
     pict.linesize[2] = vp->bmp->pitches[1];
     
     // Convert the image into YUV format that SDL uses
-    img_convert(&pict, dst_pix_fmt,
-		(AVPicture *)pFrame, is->video_st->codec->pix_fmt, 
-		is->video_st->codec->width, is->video_st->codec->height);
+    if(is->video_st->codec->pix_fmt == dst_pix_fmt) {
+      /* nothing to convert, copy the planes as they are */
+      av_picture_copy(&pict, (AVPicture *)pFrame, dst_pix_fmt,
+		      is->video_st->codec->width, is->video_st->codec->height);
+    } else {
+      img_convert(&pict, dst_pix_fmt,
+		  (AVPicture *)pFrame, is->video_st->codec->pix_fmt, 
+		  is->video_st->codec->width, is->video_st->codec->height);
+    }
     
     SDL_UnlockYUVOverlay(vp->bmp);
     vp->pts = pts;
 
     /* now we inform our display thread that we have a pic ready */
-    if(++is->pictq_windex == VIDEO_PICTURE_QUEUE_SIZE) {
+    if(++is->pictq_windex == is->pictq_capacity) {
       is->pictq_windex = 0;
     }
     SDL_LockMutex(is->pictq_mutex);
     is->pictq_size++;
+    if(is->pictq_waiting) {
+      SDL_Event event;
+
+      is->pictq_waiting = 0;
+      event.type = FF_REFRESH_EVENT;
+      event.user.data1 = is;
+      SDL_PushEvent(&event);
+    }
     SDL_UnlockMutex(is->pictq_mutex);
   }
   return 0;
@@ -531,6 +562,9 @@ int video_thread(void *arg) {
     }
     pts = 0;
 
+    is->video_st->codec->skip_frame =
+      __atomic_load_n(&is->skip_nonref, __ATOMIC_RELAXED) ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+
     // Save global pts to be stored in pFrame in first call
     global_video_pkt_pts = packet->pts;
     // Decode video frame
@@ -591,7 +625,11 @@ int stream_component_open(VideoState *is, int stream_index) {
   }
   codec = avcodec_find_decoder(codecCtx->codec_id);
 
-  if(!codec || (avcodec_open(codecCtx, codec) < 0)) {
+  /* frame threading returns each picture thread_count packets late, so
+     the pts our_get_buffer takes from the current packet would be wrong */
+  if(!codec || (decoder_open(codecCtx, codec, 0,
+			     codecCtx->codec_type == CODEC_TYPE_VIDEO ?
+			     FF_THREAD_SLICE : 0) < 0)) {
     fprintf(stderr, "Unsupported codec!\n");
     return -1;
   }
@@ -604,6 +642,9 @@ int stream_component_open(VideoState *is, int stream_index) {
     is->audio_buf_index = 0;
     memset(&is->audio_pkt, 0, sizeof(is->audio_pkt));
     packet_queue_init(&is->audioq);
+    stream_router_set_queue(&is->router, stream_index, &is->audioq);
+    packet_queue_set_capacity(&is->audioq, 0, MAX_AUDIOQ_SIZE,
+			      MAX_QUEUE_DURATION / av_q2d(is->audio_st->time_base));
     SDL_PauseAudio(0);
     break;
   case CODEC_TYPE_VIDEO:
@@ -614,6 +655,16 @@ int stream_component_open(VideoState *is, int stream_index) {
     is->frame_last_delay = 40e-3;
 
     packet_queue_init(&is->videoq);
+    stream_router_set_queue(&is->router, stream_index, &is->videoq);
+    packet_queue_set_capacity(&is->videoq, 0, MAX_VIDEOQ_SIZE,
+			      MAX_QUEUE_DURATION / av_q2d(is->video_st->time_base));
+    {
+      /* preallocate the overlays on the main thread */
+      SDL_Event event;
+      event.type = FF_ALLOC_EVENT;
+      event.user.data1 = is;
+      SDL_PushEvent(&event);
+    }
     is->video_tid = SDL_CreateThread(video_thread, is);
     codecCtx->get_buffer = our_get_buffer;
     codecCtx->release_buffer = our_release_buffer;
@@ -655,6 +706,10 @@ int decode_thread(void *arg) {
   // Retrieve stream information
   if(av_find_stream_info(pFormatCtx)<0)
     return -1; // Couldn't find stream information
+
+  // one route per stream, however many the file has
+  if(stream_router_init(&is->router, pFormatCtx->nb_streams) < 0)
+    return -1;
   
   // Dump information about file onto standard error
   dump_format(pFormatCtx, 0, is->filename, 0);
@@ -690,25 +745,17 @@ int decode_thread(void *arg) {
       break;
     }
     // seek stuff goes here
-    if(is->audioq.size > MAX_AUDIOQ_SIZE ||
-       is->videoq.size > MAX_VIDEOQ_SIZE) {
-      SDL_Delay(10);
-      continue;
-    }
     if(av_read_frame(is->pFormatCtx, packet) < 0) {
       if(url_ferror(&pFormatCtx->pb) == 0) {
+	stream_router_publish(&is->router);
 	SDL_Delay(100); /* no error; wait for user input */
 	continue;
       } else {
 	break;
       }
     }
-    // Is this a packet from the video stream?
-    if(packet->stream_index == is->videoStream) {
-      packet_queue_put(&is->videoq, packet);
-    } else if(packet->stream_index == is->audioStream) {
-      packet_queue_put(&is->audioq, packet);
-    } else {
+    // Hand the packet to whoever reads its stream
+    if(stream_router_dispatch(&is->router, packet) <= 0) {
       av_free_packet(packet);
     }
   }
@@ -727,6 +774,19 @@ int decode_thread(void *arg) {
   return 0;
 }
 
+/* Sets quit and wakes every thread that may be asleep, including a
+   demuxer blocked on a full queue, then waits for them to finish. */
+void stop_threads(VideoState *is) {
+  is->quit = 1;
+  stream_router_stop(&is->router);
+  SDL_LockMutex(is->pictq_mutex);
+  SDL_CondBroadcast(is->pictq_cond);
+  SDL_UnlockMutex(is->pictq_mutex);
+
+  SDL_WaitThread(is->video_tid, NULL);
+  SDL_WaitThread(is->parse_tid, NULL);
+}
+
 int main(int argc, char *argv[]) {
 
   SDL_Event       event;
@@ -735,14 +795,19 @@ int main(int argc, char *argv[]) {
 
   is = av_mallocz(sizeof(VideoState));
 
+  if(argc > 3 && !strcmp(argv[1], "-pictq")) {
+    is->pictq_capacity = atoi(argv[2]);
+    argv += 2;
+    argc -= 2;
+  }
   if(argc < 2) {
-    fprintf(stderr, "Usage: test <file>\n");
+    fprintf(stderr, "Usage: test [-pictq <frames>] <file>\n");
     exit(1);
   }
   // Register all formats and codecs
   av_register_all();
   
-  if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER)) {
+  if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO)) {
     fprintf(stderr, "Could not initialize SDL - %s\n", SDL_GetError());
     exit(1);
   }
@@ -762,30 +827,48 @@ int main(int argc, char *argv[]) {
 
   is->pictq_mutex = SDL_CreateMutex();
   is->pictq_cond = SDL_CreateCond();
+  if(is->pictq_capacity < 1 || is->pictq_capacity > MAX_PICTURE_QUEUE_SIZE) {
+    is->pictq_capacity = VIDEO_PICTURE_QUEUE_SIZE;
+  }
+  is->pictq = av_mallocz(is->pictq_capacity * sizeof(VideoPicture));
 
-  schedule_refresh(is, 40);
+  schedule_refresh(is, 0.04);
 
   is->parse_tid = SDL_CreateThread(decode_thread, is);
   if(!is->parse_tid) {
     av_free(is);
     return -1;
   }
+  /* SDL video is only touched from this thread: it shows each picture
+     when it is due and sleeps in between, waking up for events; with
+     nothing to show it just waits for the next event */
   for(;;) {
 
-    SDL_WaitEvent(&event);
+    if(monotonic_ns() >= is->refresh_time) {
+      video_refresh_timer(is);
+    }
+    if(!SDL_PollEvent(&event)) {
+      if(refresh_idle(is)) {
+	/* idle: block until a key, a picture or quit arrives */
+	SDL_WaitEvent(&event);
+      } else {
+	wait_refresh(is);
+	continue;
+      }
+    }
     switch(event.type) {
     case FF_QUIT_EVENT:
     case SDL_QUIT:
-      is->quit = 1;
+      stop_threads(is);
+      fprintf(stderr, "%d pictures dropped, %d shown late, "
+	      "non-reference frames skipped %d times\n",
+	      is->frames_dropped, is->frames_late, is->skip_nonref_periods);
       SDL_Quit();
       exit(0);
       break;
     case FF_ALLOC_EVENT:
       alloc_picture(event.user.data1);
       break;
-    case FF_REFRESH_EVENT:
-      video_refresh_timer(event.user.data1);
-      break;
     default:
       break;
     }
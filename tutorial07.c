@@ -6,7 +6,7 @@
 // Tested on Gentoo, CVS version 5/01/07 compiled with GCC 4.1.1
 // Use
 //
-// gcc -o tutorial07 tutorial07.c -lavformat -lavcodec -lz -lm `sdl-config --cflags --libs`
+// gcc -o tutorial07 tutorial07.c decoder.c packet_queue.c stream_router.c seek_index.c sync_clock.c -lavformat -lavcodec -lavutil -lz -lm -lrt `sdl-config --cflags --libs`
 // to build (assuming libavformat and libavcodec are correctly installed, 
 // and assuming you have sdl-config. Please refer to SDL docs for your installation.)
 //
@@ -15,6 +15,11 @@
 //
 // to play the video.
 
+#include "decoder.h"
+#include "packet_queue.h"
+#include "seek_index.h"
+#include "stream_router.h"
+#include "sync_clock.h"
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <SDL.h>
@@ -23,28 +28,29 @@
 #undef main /* Prevents SDL from overriding main() */
 #endif
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
+#include <errno.h>
+#include <time.h>
 
 #define SDL_AUDIO_BUFFER_SIZE 1024
 #define MAX_AUDIOQ_SIZE (5 * 16 * 1024)
 #define MAX_VIDEOQ_SIZE (5 * 256 * 1024)
+#define MAX_QUEUE_DURATION 10.0
 #define AV_SYNC_THRESHOLD 0.01
 #define AV_NOSYNC_THRESHOLD 10.0
+#define EXTERNAL_CLOCK_MAX_DRIFT 0.1 /* seconds the external clock may stray from audio before it is reset */
+#define LATE_STREAK_SKIP_NONREF 8 /* late pictures in a row before the decoder sheds work */
 #define SAMPLE_CORRECTION_PERCENT_MAX 10
 #define AUDIO_DIFF_AVG_NB 20
 #define FF_ALLOC_EVENT   (SDL_USEREVENT)
 #define FF_REFRESH_EVENT (SDL_USEREVENT + 1)
 #define FF_QUIT_EVENT (SDL_USEREVENT + 2)
-#define VIDEO_PICTURE_QUEUE_SIZE 1
+#define EVENT_POLL_INTERVAL 0.01 /* longest the main thread sleeps without checking events */
+#define VIDEO_PICTURE_QUEUE_SIZE 3 /* default depth, -pictq overrides it */
+#define MAX_PICTURE_QUEUE_SIZE 64
 #define DEFAULT_AV_SYNC_TYPE AV_SYNC_VIDEO_MASTER
 
-typedef struct PacketQueue {
-  AVPacketList *first_pkt, *last_pkt;
-  int nb_packets;
-  int size;
-  SDL_mutex *mutex;
-  SDL_cond *cond;
-} PacketQueue;
 typedef struct VideoPicture {
   SDL_Overlay *bmp;
   int width, height; /* source height & width */
@@ -57,11 +63,15 @@ typedef struct VideoState {
   int             videoStream, audioStream;
 
   int             av_sync_type;
-  double          external_clock; /* external clock base */
-  int64_t         external_clock_time;
   int             seek_req;
   int             seek_flags;
   int64_t         seek_pos;
+  SDL_mutex       *seek_mutex; /* guards seek_req, seek_flags and seek_pos */
+  SDL_cond        *seek_cond;
+  SeekIndex       seek_index; /* keyframe sidecar, nb_entries is 0 if none */
+  int             accurate_seek; /* decode forward from the keyframe to seek_pos */
+  double          seek_target; /* seconds, what comes before it is dropped after a flush */
+  int             audio_skipping;
 
   double          audio_clock;
   AVStream        *audio_st;
@@ -77,22 +87,33 @@ typedef struct VideoState {
   double          audio_diff_avg_coef;
   double          audio_diff_threshold;
   int             audio_diff_avg_count;
-  double          frame_timer;
+  int64_t         frame_timer; /* sync_clock_now() time the current picture is due */
   double          frame_last_pts;
   double          frame_last_delay;
   double          video_clock; ///<pts of last decoded frame / predicted pts of next decoded frame
-  double          video_current_pts; ///<current displayed pts (different from video_clock if frame fifos are used)
-  int64_t         video_current_pts_time;  ///<time (av_gettime) at which we updated video_current_pts - used to have running video pts
+  SyncClock       vidclk; ///<current displayed pts (different from video_clock if frame fifos are used)
+  SyncClock       audclk; ///<pts of the sample being played, set by the audio callback
+  SyncClock       extclk; ///<external master, kept close to the audio clock
   AVStream        *video_st;
   PacketQueue     videoq;
-  VideoPicture    pictq[VIDEO_PICTURE_QUEUE_SIZE];
+  StreamRouter    router; /* stream index to packet queue */
+  VideoPicture    *pictq; /* ring of pictq_capacity pictures */
+  int             pictq_capacity;
   int             pictq_size, pictq_rindex, pictq_windex;
+  int             frames_dropped, frames_late;
+  int             late_streak;
+  int             skip_nonref; /* stored by the refresh timer, loaded by the video thread, atomically */
+  int             skip_nonref_periods;
   SDL_mutex       *pictq_mutex;
   SDL_cond        *pictq_cond;
+  int             pictq_waiting; /* main thread waits for an FF_REFRESH_EVENT */
   SDL_Thread      *parse_tid;
   SDL_Thread      *video_tid;
+  int64_t         refresh_time; /* next picture deadline, CLOCK_MONOTONIC ns */
 
   char            filename[1024];
+  int             paused;
+  int64_t         pause_start; /* sync_clock_now() when paused */
   int             quit;
 } VideoState;
 
@@ -109,88 +130,18 @@ SDL_Surface     *screen;
 VideoState *global_video_state;
 AVPacket flush_pkt;
 
-void packet_queue_init(PacketQueue *q) {
-  memset(q, 0, sizeof(PacketQueue));
-  q->mutex = SDL_CreateMutex();
-  q->cond = SDL_CreateCond();
-}
-int packet_queue_put(PacketQueue *q, AVPacket *pkt) {
+/* queues a reference to flush_pkt, each consumer frees its own */
+static void packet_queue_put_flush(PacketQueue *q) {
+  AVPacket pkt = flush_pkt;
 
-  AVPacketList *pkt1;
-  if(pkt != &flush_pkt && av_dup_packet(pkt) < 0) {
-    return -1;
+  pkt.buf = av_buffer_ref(flush_pkt.buf);
+  if(!pkt.buf || packet_queue_put(q, &pkt) < 0) {
+    av_free_packet(&pkt);
   }
-  pkt1 = av_malloc(sizeof(AVPacketList));
-  if (!pkt1)
-    return -1;
-  pkt1->pkt = *pkt;
-  pkt1->next = NULL;
-  
-  SDL_LockMutex(q->mutex);
-
-  if (!q->last_pkt)
-    q->first_pkt = pkt1;
-  else
-    q->last_pkt->next = pkt1;
-  q->last_pkt = pkt1;
-  q->nb_packets++;
-  q->size += pkt1->pkt.size;
-  SDL_CondSignal(q->cond);
-  
-  SDL_UnlockMutex(q->mutex);
-  return 0;
 }
-static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block)
-{
-  AVPacketList *pkt1;
-  int ret;
 
-  SDL_LockMutex(q->mutex);
-  
-  for(;;) {
-    
-    if(global_video_state->quit) {
-      ret = -1;
-      break;
-    }
-
-    pkt1 = q->first_pkt;
-    if (pkt1) {
-      q->first_pkt = pkt1->next;
-      if (!q->first_pkt)
-	q->last_pkt = NULL;
-      q->nb_packets--;
-      q->size -= pkt1->pkt.size;
-      *pkt = pkt1->pkt;
-      av_free(pkt1);
-      ret = 1;
-      break;
-    } else if (!block) {
-      ret = 0;
-      break;
-    } else {
-      SDL_CondWait(q->cond, q->mutex);
-    }
-  }
-  SDL_UnlockMutex(q->mutex);
-  return ret;
-}
-static void packet_queue_flush(PacketQueue *q) {
-  AVPacketList *pkt, *pkt1;
-
-  SDL_LockMutex(q->mutex);
-  for(pkt = q->first_pkt; pkt != NULL; pkt = pkt1) {
-    pkt1 = pkt->next;
-    av_free_packet(&pkt->pkt);
-    av_freep(&pkt);
-  }
-  q->last_pkt = NULL;
-  q->first_pkt = NULL;
-  q->nb_packets = 0;
-  q->size = 0;
-  SDL_UnlockMutex(q->mutex);
-}
-double get_audio_clock(VideoState *is) {
+/* pts of the sample the device is playing, only valid in the audio callback */
+static double audio_callback_pts(VideoState *is) {
   double pts;
   int hw_buf_size, bytes_per_sec, n;
 
@@ -206,14 +157,14 @@ double get_audio_clock(VideoState *is) {
   }
   return pts;
 }
+double get_audio_clock(VideoState *is) {
+  return sync_clock_get(&is->audclk) / 1e9;
+}
 double get_video_clock(VideoState *is) {
-  double delta;
-
-  delta = (av_gettime() - is->video_current_pts_time) / 1000000.0;
-  return is->video_current_pts + delta;
+  return sync_clock_get(&is->vidclk) / 1e9;
 }
 double get_external_clock(VideoState *is) {
-  return av_gettime() / 1000000.0;
+  return sync_clock_get(&is->extclk) / 1e9;
 }
 double get_master_clock(VideoState *is) {
   if(is->av_sync_type == AV_SYNC_VIDEO_MASTER) {
@@ -288,7 +239,7 @@ int synchronize_audio(VideoState *is, short *samples,
 
 int audio_decode_frame(VideoState *is, uint8_t *audio_buf, int buf_size, double *pts_ptr) {
 
-  int len1, data_size, n;
+  int len1, data_size, n, skip;
   AVPacket *pkt = &is->audio_pkt;
   double pts;
 
@@ -310,11 +261,26 @@ int audio_decode_frame(VideoState *is, uint8_t *audio_buf, int buf_size, double
 	continue;
       }
       pts = is->audio_clock;
-      *pts_ptr = pts;
       n = 2 * is->audio_st->codec->channels;
       is->audio_clock += (double)data_size /
 	(double)(n * is->audio_st->codec->sample_rate);
 
+      if(is->audio_skipping) {
+	if(is->audio_clock <= is->seek_target) {
+	  /* entirely before the accurate seek target */
+	  continue;
+	}
+	/* cut off the samples in front of it */
+	skip = (int)((is->seek_target - pts) * is->audio_st->codec->sample_rate) * n;
+	if(skip > 0) {
+	  memmove(audio_buf, audio_buf + skip, data_size - skip);
+	  data_size -= skip;
+	  pts = is->seek_target;
+	}
+	is->audio_skipping = 0;
+      }
+      *pts_ptr = pts;
+
       /* We have data, return it and come back for more later */
       return data_size;
     }
@@ -330,6 +296,7 @@ int audio_decode_frame(VideoState *is, uint8_t *audio_buf, int buf_size, double
     }
     if(pkt->data == flush_pkt.data) {
       avcodec_flush_buffers(is->audio_st->codec);
+      is->audio_skipping = is->accurate_seek;
       continue;
     }
     is->audio_pkt_data = pkt->data;
@@ -346,6 +313,7 @@ void audio_callback(void *userdata, Uint8 *stream, int len) {
   VideoState *is = (VideoState *)userdata;
   int len1, audio_size;
   double pts;
+  int64_t played;
 
   while(len > 0) {
     if(is->audio_buf_index >= is->audio_buf_size) {
@@ -370,19 +338,16 @@ void audio_callback(void *userdata, Uint8 *stream, int len) {
     stream += len1;
     is->audio_buf_index += len1;
   }
+  /* publish through the clocks, the other threads never read audio_clock */
+  played = (int64_t)(audio_callback_pts(is) * 1e9);
+  sync_clock_set(&is->audclk, played);
+  sync_clock_correct(&is->extclk, played,
+		     (int64_t)(EXTERNAL_CLOCK_MAX_DRIFT * 1e9));
 }
 
-static Uint32 sdl_refresh_timer_cb(Uint32 interval, void *opaque) {
-  SDL_Event event;
-  event.type = FF_REFRESH_EVENT;
-  event.user.data1 = opaque;
-  SDL_PushEvent(&event);
-  return 0; /* 0 means stop timer */
-}
-
-/* schedule a video refresh in 'delay' ms */
-static void schedule_refresh(VideoState *is, int delay) {
-  SDL_AddTimer(delay, sdl_refresh_timer_cb, is);
+/* schedule a video refresh in 'delay' seconds */
+static void schedule_refresh(VideoState *is, double delay) {
+  is->refresh_time = sync_clock_now() + (int64_t)(delay * 1e9);
 }
 
 void video_display(VideoState *is) {
@@ -428,15 +393,27 @@ void video_refresh_timer(void *userdata) {
   VideoState *is = (VideoState *)userdata;
   VideoPicture *vp;
   double actual_delay, delay, sync_threshold, ref_clock, diff;
+  int pictq_size;
   
+  if(is->paused) {
+    schedule_refresh(is, 0.01);
+    return;
+  }
   if(is->video_st) {
-    if(is->pictq_size == 0) {
-      schedule_refresh(is, 1);
+    /* under the lock, so the decoder's setup of frame_timer is visible */
+    SDL_LockMutex(is->pictq_mutex);
+    pictq_size = is->pictq_size;
+    SDL_UnlockMutex(is->pictq_mutex);
+    if(pictq_size == 0) {
+      /* nothing to show, sleep until queue_picture sends an event */
+      SDL_LockMutex(is->pictq_mutex);
+      is->pictq_waiting = is->pictq_size == 0;
+      SDL_UnlockMutex(is->pictq_mutex);
+      schedule_refresh(is, 0);
     } else {
       vp = &is->pictq[is->pictq_rindex];
 
-      is->video_current_pts = vp->pts;
-      is->video_current_pts_time = av_gettime();
+      sync_clock_set(&is->vidclk, (int64_t)(vp->pts * 1e9));
 
       delay = vp->pts - is->frame_last_pts; /* the pts from last time */
       if(delay <= 0 || delay >= 1.0) {
@@ -464,20 +441,41 @@ void video_refresh_timer(void *userdata) {
 	}
       }
 
-      is->frame_timer += delay;
+      is->frame_timer += (int64_t)(delay * 1e9);
       /* computer the REAL delay */
-      actual_delay = is->frame_timer - (av_gettime() / 1000000.0);
-      if(actual_delay < 0.010) {
-	/* Really it should skip the picture instead */
-	actual_delay = 0.010;
+      actual_delay = (is->frame_timer - sync_clock_now()) / 1e9;
+
+      if(actual_delay < 0) {
+	is->late_streak++;
+      } else {
+	is->late_streak = 0;
       }
-      schedule_refresh(is, (int)(actual_delay * 1000 + 0.5));
+      /* persistently behind: let the decoder drop what nothing refers to */
+      if(!is->skip_nonref && is->late_streak >= LATE_STREAK_SKIP_NONREF) {
+	is->skip_nonref_periods++;
+      }
+      __atomic_store_n(&is->skip_nonref, is->late_streak >= LATE_STREAK_SKIP_NONREF,
+		       __ATOMIC_RELAXED);
+
+      if(actual_delay <= -delay && pictq_size > 1) {
+	/* the next picture is due already, skip this one */
+	is->frames_dropped++;
+	schedule_refresh(is, 0.001);
+      } else {
+	if(actual_delay < 0) {
+	  is->frames_late++;
+	}
+	if(actual_delay < 0.010) {
+	  actual_delay = 0.010;
+	}
+	schedule_refresh(is, actual_delay);
 
-      /* show the picture! */
-      video_display(is);
+	/* show the picture! */
+	video_display(is);
+      }
       
       /* update queue for next picture! */
-      if(++is->pictq_rindex == VIDEO_PICTURE_QUEUE_SIZE) {
+      if(++is->pictq_rindex == is->pictq_capacity) {
 	is->pictq_rindex = 0;
       }
       SDL_LockMutex(is->pictq_mutex);
@@ -486,30 +484,85 @@ void video_refresh_timer(void *userdata) {
       SDL_UnlockMutex(is->pictq_mutex);
     }
   } else {
-    schedule_refresh(is, 100);
+    schedule_refresh(is, 0.1);
+  }
+}
+
+/* True while the picture queue is empty and the main thread may block
+   in SDL_WaitEvent, queue_picture wakes it with an FF_REFRESH_EVENT. */
+static int refresh_idle(VideoState *is) {
+  int idle;
+
+  SDL_LockMutex(is->pictq_mutex);
+  idle = is->pictq_waiting;
+  SDL_UnlockMutex(is->pictq_mutex);
+  return idle;
+}
+
+/* Sleeps until the next picture is due, but wakes at least every
+   EVENT_POLL_INTERVAL so the main thread keeps pumping events. */
+static void wait_refresh(VideoState *is) {
+  struct timespec ts;
+  int64_t wake = sync_clock_now() + (int64_t)(EVENT_POLL_INTERVAL * 1e9);
+
+  if(wake > is->refresh_time) {
+    wake = is->refresh_time;
+  }
+  ts.tv_sec = wake / 1000000000;
+  ts.tv_nsec = wake % 1000000000;
+  while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+void toggle_pause(VideoState *is) {
+  is->paused = !is->paused;
+  if(is->paused) {
+    is->pause_start = sync_clock_now();
+  } else {
+    /* push the schedule back by the time spent paused */
+    is->frame_timer += sync_clock_now() - is->pause_start;
   }
+  sync_clock_set_paused(&is->vidclk, is->paused);
+  sync_clock_set_paused(&is->audclk, is->paused);
+  sync_clock_set_paused(&is->extclk, is->paused);
+  SDL_PauseAudio(is->paused);
 }
       
 void alloc_picture(void *userdata) {
 
   VideoState *is = (VideoState *)userdata;
   VideoPicture *vp;
+  int i, nb_free;
 
-  vp = &is->pictq[is->pictq_windex];
-  if(vp->bmp) {
-    // we already have one make another, bigger/smaller
-    SDL_FreeYUVOverlay(vp->bmp);
-  }
-  // Allocate a place to put our YUV image on that screen
-  vp->bmp = SDL_CreateYUVOverlay(is->video_st->codec->width,
-				 is->video_st->codec->height,
-				 SDL_YV12_OVERLAY,
-				 screen);
-  vp->width = is->video_st->codec->width;
-  vp->height = is->video_st->codec->height;
-  
+  /* (re)allocate every slot that holds no queued picture, so the
+     whole ring is ready before the first frame is decoded; the lock is
+     held throughout, queue_picture checks the slots under it too */
   SDL_LockMutex(is->pictq_mutex);
-  vp->allocated = 1;
+  nb_free = is->pictq_capacity - is->pictq_size;
+
+  for(i = 0; i < nb_free; i++) {
+    vp = &is->pictq[(is->pictq_windex + i) % is->pictq_capacity];
+    if(vp->bmp &&
+       vp->width == is->video_st->codec->width &&
+       vp->height == is->video_st->codec->height) {
+      continue;
+    }
+    if(vp->bmp) {
+      // we already have one make another, bigger/smaller
+      SDL_FreeYUVOverlay(vp->bmp);
+    }
+    // Allocate a place to put our YUV image on that screen
+    vp->bmp = SDL_CreateYUVOverlay(is->video_st->codec->width,
+				   is->video_st->codec->height,
+				   SDL_YV12_OVERLAY,
+				   screen);
+    vp->width = is->video_st->codec->width;
+    vp->height = is->video_st->codec->height;
+  }
+
+  for(i = 0; i < nb_free; i++) {
+    is->pictq[(is->pictq_windex + i) % is->pictq_capacity].allocated = 1;
+  }
   SDL_CondSignal(is->pictq_cond);
   SDL_UnlockMutex(is->pictq_mutex);
 
@@ -523,19 +576,21 @@ int queue_picture(VideoState *is, AVFrame *pFrame, double pts) {
 
   /* wait until we have space for a new pic */
   SDL_LockMutex(is->pictq_mutex);
-  while(is->pictq_size >= VIDEO_PICTURE_QUEUE_SIZE &&
+  while(is->pictq_size >= is->pictq_capacity &&
 	!is->quit) {
     SDL_CondWait(is->pictq_cond, is->pictq_mutex);
   }
-  SDL_UnlockMutex(is->pictq_mutex);
 
-  if(is->quit)
+  if(is->quit) {
+    SDL_UnlockMutex(is->pictq_mutex);
     return -1;
+  }
 
   // windex is set to 0 initially
   vp = &is->pictq[is->pictq_windex];
 
-  /* allocate or resize the buffer! */
+  /* allocate or resize the buffer! still under the lock, the main
+     thread may be replacing the overlay right now */
   if(!vp->bmp ||
      vp->width != is->video_st->codec->width ||
      vp->height != is->video_st->codec->height) {
@@ -548,15 +603,17 @@ int queue_picture(VideoState *is, AVFrame *pFrame, double pts) {
     SDL_PushEvent(&event);
 
     /* wait until we have a picture allocated */
-    SDL_LockMutex(is->pictq_mutex);
     while(!vp->allocated && !is->quit) {
       SDL_CondWait(is->pictq_cond, is->pictq_mutex);
     }
-    SDL_UnlockMutex(is->pictq_mutex);
     if(is->quit) {
+      SDL_UnlockMutex(is->pictq_mutex);
       return -1;
     }
   }
+  /* the main thread only replaces overlays that do not match the codec
+     size, which this one does until the next frame is decoded */
+  SDL_UnlockMutex(is->pictq_mutex);
   /* We have a place to put our picture on the queue */
   /* If we are skipping a frame, do we set this to null 
      but still return vp->allocated = 1? */
@@ -578,19 +635,33 @@ int queue_picture(VideoState *is, AVFrame *pFrame, double pts) {
     pict.linesize[2] = vp->bmp->pitches[1];
     
     // Convert the image into YUV format that SDL uses
-    img_convert(&pict, dst_pix_fmt,
-		(AVPicture *)pFrame, is->video_st->codec->pix_fmt, 
-		is->video_st->codec->width, is->video_st->codec->height);
+    if(is->video_st->codec->pix_fmt == dst_pix_fmt) {
+      /* nothing to convert, copy the planes as they are */
+      av_picture_copy(&pict, (AVPicture *)pFrame, dst_pix_fmt,
+		      is->video_st->codec->width, is->video_st->codec->height);
+    } else {
+      img_convert(&pict, dst_pix_fmt,
+		  (AVPicture *)pFrame, is->video_st->codec->pix_fmt, 
+		  is->video_st->codec->width, is->video_st->codec->height);
+    }
     
     SDL_UnlockYUVOverlay(vp->bmp);
     vp->pts = pts;
 
     /* now we inform our display thread that we have a pic ready */
-    if(++is->pictq_windex == VIDEO_PICTURE_QUEUE_SIZE) {
+    if(++is->pictq_windex == is->pictq_capacity) {
       is->pictq_windex = 0;
     }
     SDL_LockMutex(is->pictq_mutex);
     is->pictq_size++;
+    if(is->pictq_waiting) {
+      SDL_Event event;
+
+      is->pictq_waiting = 0;
+      event.type = FF_REFRESH_EVENT;
+      event.user.data1 = is;
+      SDL_PushEvent(&event);
+    }
     SDL_UnlockMutex(is->pictq_mutex);
   }
   return 0;
@@ -639,6 +710,7 @@ int video_thread(void *arg) {
   int len1, frameFinished;
   AVFrame *pFrame;
   double pts;
+  int skipping = 0;
 
   pFrame = avcodec_alloc_frame();
 
@@ -649,10 +721,15 @@ int video_thread(void *arg) {
     }
     if(packet->data == flush_pkt.data) {
       avcodec_flush_buffers(is->video_st->codec);
+      skipping = is->accurate_seek;
+      av_free_packet(packet);
       continue;
     }
     pts = 0;
 
+    is->video_st->codec->skip_frame =
+      __atomic_load_n(&is->skip_nonref, __ATOMIC_RELAXED) ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+
     // Save global pts to be stored in pFrame in first call
     global_video_pkt_pts = packet->pts;
     // Decode video frame
@@ -671,6 +748,13 @@ int video_thread(void *arg) {
     // Did we get a video frame?
     if(frameFinished) {
       pts = synchronize_video(is, pFrame, pts);
+      /* frames that end before an accurate seek target are dropped
+	 here, before any conversion or overlay upload */
+      if(skipping && is->video_clock <= is->seek_target) {
+	av_free_packet(packet);
+	continue;
+      }
+      skipping = 0;
       if(queue_picture(is, pFrame, pts) < 0) {
 	break;
       }
@@ -711,7 +795,11 @@ int stream_component_open(VideoState *is, int stream_index) {
     is->audio_hw_buf_size = spec.size;
   }
   codec = avcodec_find_decoder(codecCtx->codec_id);
-  if(!codec || (avcodec_open(codecCtx, codec) < 0)) {
+  /* frame threading returns each picture thread_count packets late, so
+     the pts our_get_buffer takes from the current packet would be wrong */
+  if(!codec || (decoder_open(codecCtx, codec, 0,
+			     codecCtx->codec_type == CODEC_TYPE_VIDEO ?
+			     FF_THREAD_SLICE : 0) < 0)) {
     fprintf(stderr, "Unsupported codec!\n");
     return -1;
   }
@@ -731,17 +819,29 @@ int stream_component_open(VideoState *is, int stream_index) {
 
     memset(&is->audio_pkt, 0, sizeof(is->audio_pkt));
     packet_queue_init(&is->audioq);
+    stream_router_set_queue(&is->router, stream_index, &is->audioq);
+    packet_queue_set_capacity(&is->audioq, 0, MAX_AUDIOQ_SIZE,
+			      MAX_QUEUE_DURATION / av_q2d(is->audio_st->time_base));
     SDL_PauseAudio(0);
     break;
   case CODEC_TYPE_VIDEO:
     is->videoStream = stream_index;
     is->video_st = pFormatCtx->streams[stream_index];
 
-    is->frame_timer = (double)av_gettime() / 1000000.0;
+    is->frame_timer = sync_clock_now();
     is->frame_last_delay = 40e-3;
-    is->video_current_pts_time = av_gettime();
 
     packet_queue_init(&is->videoq);
+    stream_router_set_queue(&is->router, stream_index, &is->videoq);
+    packet_queue_set_capacity(&is->videoq, 0, MAX_VIDEOQ_SIZE,
+			      MAX_QUEUE_DURATION / av_q2d(is->video_st->time_base));
+    {
+      /* preallocate the overlays on the main thread */
+      SDL_Event event;
+      event.type = FF_ALLOC_EVENT;
+      event.user.data1 = is;
+      SDL_PushEvent(&event);
+    }
     is->video_tid = SDL_CreateThread(video_thread, is);
     codecCtx->get_buffer = our_get_buffer;
     codecCtx->release_buffer = our_release_buffer;
@@ -762,6 +862,13 @@ int decode_thread(void *arg) {
   VideoState *is = (VideoState *)arg;
   AVFormatContext *pFormatCtx;
   AVPacket pkt1, *packet = &pkt1;
+  char index_filename[1024 + 4];
+  const SeekIndexEntry *entry;
+  int ret;
+  int seek_req;
+  int64_t seek_pos;
+  int seek_flags;
+  int held = 0; /* packet is still ours, a seek interrupted its dispatch */
 
   int video_index = -1;
   int audio_index = -1;
@@ -783,6 +890,10 @@ int decode_thread(void *arg) {
   // Retrieve stream information
   if(av_find_stream_info(pFormatCtx)<0)
     return -1; // Couldn't find stream information
+
+  // one route per stream, however many the file has
+  if(stream_router_init(&is->router, pFormatCtx->nb_streams) < 0)
+    return -1;
   
   // Dump information about file onto standard error
   dump_format(pFormatCtx, 0, is->filename, 0);
@@ -810,6 +921,13 @@ int decode_thread(void *arg) {
     goto fail;
   }
 
+  // seek by byte offset when build_seek_index has written a sidecar
+  seek_index_filename(index_filename, sizeof(index_filename), is->filename);
+  if(!seek_index_open(&is->seek_index, index_filename, is->filename) &&
+     is->seek_index.header->stream_index != video_index) {
+    seek_index_close(&is->seek_index);
+  }
+
   // main decode loop
 
   for(;;) {
@@ -817,9 +935,17 @@ int decode_thread(void *arg) {
       break;
     }
     // seek stuff goes here
-    if(is->seek_req) {
+    /* take the latest request; one that comes in while this one is
+       served is picked up on the next iteration */
+    SDL_LockMutex(is->seek_mutex);
+    seek_req = is->seek_req;
+    seek_pos = is->seek_pos;
+    seek_flags = is->seek_flags;
+    is->seek_req = 0;
+    SDL_UnlockMutex(is->seek_mutex);
+    if(seek_req) {
       int stream_index= -1;
-      int64_t seek_target = is->seek_pos;
+      int64_t seek_target = seek_pos;
 
       if     (is->videoStream >= 0) stream_index = is->videoStream;
       else if(is->audioStream >= 0) stream_index = is->audioStream;
@@ -827,48 +953,71 @@ int decode_thread(void *arg) {
       if(stream_index>=0){
 	seek_target= av_rescale_q(seek_target, AV_TIME_BASE_Q, pFormatCtx->streams[stream_index]->time_base);
       }
-      if(!av_seek_frame(is->pFormatCtx, stream_index, seek_target, is->seek_flags)) {
+      ret = -1;
+      if(is->seek_index.nb_entries && stream_index == is->seek_index.header->stream_index) {
+	AVRational tb = { is->seek_index.header->time_base_num,
+			  is->seek_index.header->time_base_den };
+	entry = seek_index_find(&is->seek_index,
+				av_rescale_q(seek_pos, AV_TIME_BASE_Q, tb),
+				seek_flags & AVSEEK_FLAG_BACKWARD);
+	if(entry) {
+	  ret = av_seek_frame(is->pFormatCtx, stream_index, entry->pos, AVSEEK_FLAG_BYTE);
+	}
+      }
+      if(ret < 0) {
+	ret = av_seek_frame(is->pFormatCtx, stream_index, seek_target, seek_flags);
+      }
+      if(ret < 0) {
+	/* nothing is lost, a held packet is dispatched again below */
 	fprintf(stderr, "%s: error while seeking\n", is->pFormatCtx->filename);
       } else {
+	/* read by the decoders when they get the flush packet */
+	is->seek_target = (double)seek_pos / AV_TIME_BASE;
+	if(held) {
+	  av_free_packet(packet);
+	  held = 0;
+	}
+	stream_router_flush(&is->router);
 	if(is->audioStream >= 0) {
-	  packet_queue_flush(&is->audioq);
-	  packet_queue_put(&is->audioq, &flush_pkt);
+	  packet_queue_put_flush(&is->audioq);
 	}
 	if(is->videoStream >= 0) {
-	  packet_queue_flush(&is->videoq);
-	  packet_queue_put(&is->videoq, &flush_pkt);
+	  packet_queue_put_flush(&is->videoq);
 	}
       }
-      is->seek_req = 0;
     }
 
-    if(is->audioq.size > MAX_AUDIOQ_SIZE ||
-       is->videoq.size > MAX_VIDEOQ_SIZE) {
-      SDL_Delay(10);
-      continue;
-    }
-    if(av_read_frame(is->pFormatCtx, packet) < 0) {
+    if(!held && av_read_frame(is->pFormatCtx, packet) < 0) {
       if(url_ferror(&pFormatCtx->pb) == 0) {
-	SDL_Delay(100); /* no error; wait for user input */
+	/* no error; sleep until the user seeks back */
+	stream_router_publish(&is->router);
+	SDL_LockMutex(is->seek_mutex);
+	while(!is->seek_req && !is->quit) {
+	  SDL_CondWait(is->seek_cond, is->seek_mutex);
+	}
+	SDL_UnlockMutex(is->seek_mutex);
 	continue;
       } else {
 	break;
       }
     }
-    // Is this a packet from the video stream?
-    if(packet->stream_index == is->videoStream) {
-      packet_queue_put(&is->videoq, packet);
-    } else if(packet->stream_index == is->audioStream) {
-      packet_queue_put(&is->audioq, packet);
-    } else {
+    // Hand the packet to whoever reads its stream; if its queue is full
+    // and a seek is pending, keep it until the seek has gone through
+    ret = stream_router_dispatch(&is->router, packet);
+    held = ret == AVERROR(EAGAIN);
+    if(ret <= 0 && !held) {
       av_free_packet(packet);
     }
   }
+  if(held) {
+    av_free_packet(packet);
+  }
   /* all done - wait for it */
   while(!is->quit) {
     SDL_Delay(100);
   }
  fail:
+  seek_index_close(&is->seek_index);
   {
     SDL_Event event;
     event.type = FF_QUIT_EVENT;
@@ -880,28 +1029,62 @@ int decode_thread(void *arg) {
 
 void stream_seek(VideoState *is, int64_t pos, int rel) {
 
-  if(!is->seek_req) {
-    is->seek_pos = pos;
-    is->seek_flags = rel < 0 ? AVSEEK_FLAG_BACKWARD : 0;
-    is->seek_req = 1;
-  }
+  /* a newer request replaces one that has not been served yet */
+  SDL_LockMutex(is->seek_mutex);
+  is->seek_pos = pos;
+  /* an accurate seek has to start from a keyframe before the target */
+  is->seek_flags = rel < 0 || is->accurate_seek ? AVSEEK_FLAG_BACKWARD : 0;
+  is->seek_req = 1;
+  SDL_CondSignal(is->seek_cond);
+  SDL_UnlockMutex(is->seek_mutex);
+
+  /* the demuxer may be blocked on a full queue */
+  stream_router_interrupt(&is->router);
+}
+/* Sets quit and wakes every thread that may be asleep, including a
+   demuxer blocked on a full queue, then waits for them to finish. */
+void stop_threads(VideoState *is) {
+  is->quit = 1;
+  stream_router_stop(&is->router);
+  SDL_LockMutex(is->pictq_mutex);
+  SDL_CondBroadcast(is->pictq_cond);
+  SDL_UnlockMutex(is->pictq_mutex);
+  SDL_LockMutex(is->seek_mutex);
+  SDL_CondBroadcast(is->seek_cond);
+  SDL_UnlockMutex(is->seek_mutex);
+
+  SDL_WaitThread(is->video_tid, NULL);
+  SDL_WaitThread(is->parse_tid, NULL);
 }
+
 int main(int argc, char *argv[]) {
 
   SDL_Event       event;
-  double          pts;
   VideoState      *is;
 
   is = av_mallocz(sizeof(VideoState));
 
+  while(argc > 2 && argv[1][0] == '-') {
+    if(!strcmp(argv[1], "-accurate")) {
+      is->accurate_seek = 1;
+      argv++;
+      argc--;
+    } else if(!strcmp(argv[1], "-pictq") && argc > 3) {
+      is->pictq_capacity = atoi(argv[2]);
+      argv += 2;
+      argc -= 2;
+    } else {
+      break;
+    }
+  }
   if(argc < 2) {
-    fprintf(stderr, "Usage: test <file>\n");
+    fprintf(stderr, "Usage: test [-accurate] [-pictq <frames>] <file>\n");
     exit(1);
   }
   // Register all formats and codecs
   av_register_all();
   
-  if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER)) {
+  if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO)) {
     fprintf(stderr, "Could not initialize SDL - %s\n", SDL_GetError());
     exit(1);
   }
@@ -921,25 +1104,60 @@ int main(int argc, char *argv[]) {
 
   is->pictq_mutex = SDL_CreateMutex();
   is->pictq_cond = SDL_CreateCond();
+  sync_clock_init(&is->vidclk);
+  sync_clock_init(&is->audclk);
+  sync_clock_init(&is->extclk);
+  if(is->pictq_capacity < 1 || is->pictq_capacity > MAX_PICTURE_QUEUE_SIZE) {
+    is->pictq_capacity = VIDEO_PICTURE_QUEUE_SIZE;
+  }
+  is->pictq = av_mallocz(is->pictq_capacity * sizeof(VideoPicture));
+  is->seek_mutex = SDL_CreateMutex();
+  is->seek_cond = SDL_CreateCond();
 
-  schedule_refresh(is, 40);
+  schedule_refresh(is, 0.04);
 
   is->av_sync_type = DEFAULT_AV_SYNC_TYPE;
+  /* refcounted so the queues move it instead of copying it, the
+     decoders recognise it by its data pointer */
+  av_init_packet(&flush_pkt);
+  flush_pkt.buf = av_buffer_alloc(1);
+  if(!flush_pkt.buf) {
+    fprintf(stderr, "Could not allocate the flush packet\n");
+    exit(1);
+  }
+  flush_pkt.data = flush_pkt.buf->data;
+  flush_pkt.size = 0;
+
   is->parse_tid = SDL_CreateThread(decode_thread, is);
   if(!is->parse_tid) {
     av_free(is);
     return -1;
   }
-
-  av_init_packet(&flush_pkt);
-  flush_pkt.data = "FLUSH";
-  
+  /* SDL video is only touched from this thread: it shows each picture
+     when it is due and sleeps in between, waking up for events; with
+     nothing to show it just waits for the next event */
   for(;;) {
     double incr, pos;
-    SDL_WaitEvent(&event);
+    if(sync_clock_now() >= is->refresh_time) {
+      video_refresh_timer(is);
+    }
+    if(!SDL_PollEvent(&event)) {
+      if(is->paused || refresh_idle(is)) {
+	/* idle: block until a key, a picture or quit arrives */
+	SDL_WaitEvent(&event);
+      } else {
+	wait_refresh(is);
+	continue;
+      }
+    }
     switch(event.type) {
     case SDL_KEYDOWN:
       switch(event.key.keysym.sym) {
+      case SDLK_SPACE:
+	if(global_video_state) {
+	  toggle_pause(global_video_state);
+	}
+	break;
       case SDLK_LEFT:
 	incr = -10.0;
 	goto do_seek;
@@ -954,7 +1172,15 @@ int main(int argc, char *argv[]) {
 	goto do_seek;
       do_seek:
 	if(global_video_state) {
-	  pos = get_master_clock(global_video_state);
+	  /* keep stepping from a target that has not been reached yet, so
+	     holding a key does not pile up seeks to the same place */
+	  SDL_LockMutex(global_video_state->seek_mutex);
+	  if(global_video_state->seek_req) {
+	    pos = (double)global_video_state->seek_pos / AV_TIME_BASE;
+	  } else {
+	    pos = get_master_clock(global_video_state);
+	  }
+	  SDL_UnlockMutex(global_video_state->seek_mutex);
 	  pos += incr;
 	  stream_seek(global_video_state, (int64_t)(pos * AV_TIME_BASE), incr);
 	}
@@ -965,16 +1191,19 @@ int main(int argc, char *argv[]) {
       break;
     case FF_QUIT_EVENT:
     case SDL_QUIT:
-      is->quit = 1;
+      stop_threads(is);
+      fprintf(stderr, "%d pictures dropped, %d shown late, "
+	      "non-reference frames skipped %d times\n",
+	      is->frames_dropped, is->frames_late, is->skip_nonref_periods);
       SDL_Quit();
+      sync_clock_destroy(&is->vidclk);
+      sync_clock_destroy(&is->audclk);
+      sync_clock_destroy(&is->extclk);
       exit(0);
       break;
     case FF_ALLOC_EVENT:
       alloc_picture(event.user.data1);
       break;
-    case FF_REFRESH_EVENT:
-      video_refresh_timer(event.user.data1);
-      break;
     default:
       break;
     }